@@ -17,6 +17,12 @@ Header for a platform independent renderer class, which performs Metal setup and
 // import true type defs
 #import "stb_truetype.h"
 
+// screen snapshots published by the parser
+#import "snap.h"
+
+// search of the screen and the history
+#import "search.h"
+
 typedef struct {
     char * _Nullable font_name;
     int font_height;
@@ -101,6 +107,35 @@ typedef struct {
     // compiled quads that need to be drawn using metal
     int _compiledGlyphQuads;
     
+    // every cell owns a quad, laid out for this many rows and cols
+    int _builtRows, _builtCols;
+    bool _indicesDirty;
+    
+    // first and last cell updated since the last upload
+    int _dirtyLo, _dirtyHi;
+    
+    // styles copied since the last upload, _stylesLo to _stylesHi - 1
+    int _stylesLo, _stylesHi;
+    
+    // our copy of the screen, and the styles and palette it was uploaded with
+    Frame _frame;
+    uint64_t _styleGen, _paletteGen;
+    
+    // the blink phase the cells were built with
+    int _blinkOff;
+    
+    // the view has to be drawn whatever the pacing says, after a resize
+    // or a move through the history
+    bool _mustDraw;
+    
+    // scroll wheel motion short of a whole line
+    CGFloat _wheelLines;
+    
+    // the pattern of the last find and where it was found last
+    Rune *_findPattern;
+    int _findLength;
+    Match _findMatch;
+    
     // local information to index fonts from table
     int _maxFonts;
     FontTableEntry *_fontTable;
@@ -13,11 +13,15 @@ Implementation of a platform independent renderer class, which performs Metal se
 #import "st.h"
 #import "st_types.h"
 #import "macos_support.h"
+#import "pipeline.h"
 
 extern Term term;
 extern MacOS_Cursor cursor;
 
-extern void run(void);
+_Static_assert(sizeof(Glyph_) == sizeof(((FTermBuffer *)0)->character_buffer[0]),
+               "st.h and ShaderTypes.h disagree on Glyph");
+_Static_assert(sizeof(Style_) == sizeof(((FTermBuffer *)0)->styles[0]),
+               "st.h and ShaderTypes.h disagree on Style");
 
 // Main class performing the rendering
 @implementation Renderer
@@ -226,6 +230,8 @@ char *local_strdup(char *str)
             [self setCharRow:row col:col char: 0];
         }
     }
+    // the cells have to be copied from the terminal again
+    _builtRows = _builtCols = 0;
 }
 
 - (bool) createFont: (char *) fontname size:(int)size
@@ -447,15 +453,66 @@ char *local_strdup(char *str)
     const char *str;
     str = [string UTF8String];
     
+    // the pipeline copies it and streams it out, Esc cancels the rest
     size_t len;
-    len = strlen(str);
+    len = [string lengthOfBytesUsingEncoding: NSUTF8StringEncoding];
     
     if (len)
     {
-        ttywrite(str, len, 1);
+        pipepaste(str, len);
     }
 }
 
+// ask for a pattern and select its newest match, cmd g goes on to older ones
+- (void) findEvent: (NSEvent *)event
+{
+    NSAlert *alert = [[NSAlert alloc] init];
+    NSTextField *field = [[NSTextField alloc] initWithFrame: NSMakeRect(0, 0, 240, 24)];
+    
+    alert.messageText = @"Find";
+    [alert addButtonWithTitle: @"Find"];
+    [alert addButtonWithTitle: @"Cancel"];
+    alert.accessoryView = field;
+    alert.window.initialFirstResponder = field;
+    
+    if ([alert runModal] != NSAlertFirstButtonReturn)
+        return;
+    
+    // the search goes by runes
+    NSData *runes = [field.stringValue dataUsingEncoding: NSUTF32LittleEndianStringEncoding];
+    
+    free(_findPattern);
+    _findLength = (int)(runes.length / sizeof(Rune));
+    _findPattern = malloc(runes.length + sizeof(Rune));
+    memcpy(_findPattern, runes.bytes, runes.length);
+    
+    // from past the end of the screen
+    _findMatch = (Match){ .x0 = INT_MAX, .y0 = INT_MAX };
+    [self findNext: -1];
+}
+
+// the match before the last one for dir < 0, after it otherwise
+- (void) findNext: (int)dir
+{
+    Match m;
+    int found;
+    
+    if (_findLength == 0)
+        return;
+    
+    pipelock();
+    found = tsearch(_findPattern, _findLength, _findMatch.x0, _findMatch.y0, dir, &m);
+    if (found)
+        searchshow(&m);
+    pipeunlock();
+    
+    if (found)
+        _findMatch = m;
+    else
+        NSBeep();
+    _mustDraw = true;
+}
+
 - (NSEvent *) keyEventHandler: (NSEvent *)event
 {
     STEvent *current_event;
@@ -474,6 +531,20 @@ char *local_strdup(char *str)
             return event;
     }
     
+    // shift page up and page down go through the history a page at a time
+    if (([event modifierFlags] & NSEventModifierFlagShift) &&
+        ([event keyCode] == 116 || [event keyCode] == 121))
+    {
+        pipelock();
+        if ([event keyCode] == 116)
+            kscrollup(&(Arg){ .i = -1 });
+        else
+            kscrolldown(&(Arg){ .i = -1 });
+        pipeunlock();
+        _mustDraw = true;
+        return NULL;
+    }
+    
     current_event = &_eventQueue[_numEvents++];
     
     if (_numEvents > _eventQueueSize)
@@ -494,6 +565,17 @@ char *local_strdup(char *str)
                         [self pasteEvent:event];
                         break;
                         
+                    case 3:
+                        [self findEvent:event];
+                        break;
+                        
+                    case 5:
+                        if ([event modifierFlags] & NSEventModifierFlagShift)
+                            [self findNext: 1];
+                        else
+                            [self findNext: -1];
+                        break;
+                        
                     default:
                         break;
                 }
@@ -523,6 +605,37 @@ char *local_strdup(char *str)
     return NULL;
 }
 
+- (NSEvent *) scrollEventHandler: (NSEvent *)event
+{
+    int font_size, n;
+    CGFloat lines;
+    
+    // trackpads scroll by points, wheels by lines
+    lines = [event scrollingDeltaY];
+    if ([event hasPreciseScrollingDeltas])
+    {
+        font_size = _ftBuffer->font_info[_ftBuffer->current_font].size;
+        lines /= font_size;
+    }
+    
+    // up shows older lines, whole lines only and the rest is kept
+    _wheelLines += lines;
+    n = (int)_wheelLines;
+    if (n == 0)
+        return NULL;
+    _wheelLines -= n;
+    
+    pipelock();
+    if (n > 0)
+        kscrollup(&(Arg){ .i = n });
+    else
+        kscrolldown(&(Arg){ .i = -n });
+    pipeunlock();
+    _mustDraw = true;
+    
+    return NULL;
+}
+
 - (NSEvent *) windowEventHandler: (NSEvent *)event
 {
     
@@ -548,6 +661,12 @@ char *local_strdup(char *str)
         return [self keyEventHandler: event];
      }];
 
+    mask = NSEventMaskScrollWheel;
+    
+    [NSEvent addLocalMonitorForEventsMatchingMask: mask handler: ^(NSEvent *event) {
+        return [self scrollEventHandler: event];
+     }];
+
     mask = NSEventMaskMouseEntered | NSEventMaskMouseExited;
 
     [NSEvent addLocalMonitorForEventsMatchingMask: mask handler: ^(NSEvent *event) {
@@ -603,6 +722,13 @@ void STProcessKey(STEvent *event)
     if (len == 0)
         return;
     
+    /* Esc during a long paste drops what is left of it */
+    if (len == 1 && buf[0] == '\033' && pipepasting(NULL, NULL))
+    {
+        pipepastecancel();
+        return;
+    }
+    
     if (len == 1 && (event->modifier & EventModifierFlagOption))
     {
         if (IS_SET(MODE_8BIT))
@@ -621,7 +747,7 @@ void STProcessKey(STEvent *event)
         }
     }
     
-    ttywrite(buf, len, 1);
+    pipewrite(buf, len);
 }
 
 - (void) processEventQueue
@@ -631,6 +757,13 @@ void STProcessKey(STEvent *event)
         switch(_eventQueue[i].type)
         {
             case keyDown:
+                // typing shows the screen again, output would too
+                if (_frame.scr > 0)
+                {
+                    pipelock();
+                    kscrolldown(&(Arg){ .i = INT_MAX });
+                    pipeunlock();
+                }
                 STProcessKey(&_eventQueue[i]);
                 break;
                 
@@ -743,6 +876,13 @@ void STProcessKey(STEvent *event)
         _elementBuffer = [_gpuElementBuffer contents];
         assert(_vertexBuffer);
         
+        // nothing to upload yet
+        _dirtyLo = INT_MAX;
+        _dirtyHi = -1;
+        _stylesLo = INT_MAX;
+        _stylesHi = 0;
+        _mustDraw = true;
+        
         // create the display buffer for characters and font information
         _gpuFTBuffer = [_device newBufferWithLength:sizeof(FTermBuffer) options: MTLResourceStorageModeManaged];
         assert(_gpuFTBuffer);
@@ -799,34 +939,57 @@ void STProcessKey(STEvent *event)
     
     [_gpuFTBuffer didModifyRange: NSMakeRange(0, sizeof(FTermBuffer))];
     
+    pipelock();
     macos_cresize(size.width, size.height);
+    pipeunlock();
     
     [self clearScreen];
+    _mustDraw = true;
 }
 
-- (void)processTTYInput
+- (void)buildIndices:(int)quads
 {
-    Glyph *gp;
-    int n_rows, n_cols;
-    
-    run();
+    unsigned int *indices;
+    indices = _elementBuffer;
     
-    n_rows = _ftBuffer->rows = term.row;
-    n_cols = _ftBuffer->cols = term.col;
-
-    // copy the glyphs to the gpu buffer
-    for(int row=0; row<n_rows; row++)
+    for(unsigned int i=0; i<quads; i++)
     {
-        for(int col=0; col<n_cols; col++)
-        {
-            gp = &term.line[row][col];
-            _ftBuffer->character_buffer[n_cols * row + col].u = gp->u;
-            _ftBuffer->character_buffer[n_cols * row + col].fg = gp->fg;
-            _ftBuffer->character_buffer[n_cols * row + col].bg = gp->bg;
-        }
+        // quad verts
+        // 0 --- 1
+        // |     |
+        // |     |
+        // |     |
+        // 3 --- 2
+        
+        // first triangle (0, 1, 3) clockwise
+        indices[0] = 4 * i + 0;
+        indices[1] = 4 * i + 1;
+        indices[2] = 4 * i + 3;
+        
+        // second triangle (1, 2, 3) clockwise
+        indices[3] = 4 * i + 1;
+        indices[4] = 4 * i + 2;
+        indices[5] = 4 * i + 3;
+        
+        indices += 6;
     }
     
-    // process as quads
+    _indicesDirty = true;
+}
+
+// copy columns x0 to x1 of a row to the gpu buffer and rebuild their quads
+- (void)updateRow:(int)row from:(int)x0 to:(int)x1
+{
+    Glyph *gp;
+    int n_cols, first, last;
+    
+    n_cols = _ftBuffer->cols;
+    first = n_cols * row + x0;
+    last = n_cols * row + x1;
+    
+    memcpy(&_ftBuffer->character_buffer[first], &_frame.line[_frame.col * row + x0],
+           (x1 - x0 + 1) * sizeof(Glyph));
+    
     int current_font;
     current_font = _ftBuffer->current_font;
 
@@ -834,106 +997,165 @@ void STProcessKey(STEvent *event)
     cdata = (stbtt_bakedchar *)_fontTable[current_font].cdata;
     assert(cdata);
     
-    FTermVertex *verts;
-    verts = _vertexBuffer;
-    
-    unsigned int *indices;
-    indices = _elementBuffer;
-    
-    unsigned int vert_count;
-    vert_count = 0;
-    
-    // compile number of quads to be drawn by metal
-    _compiledGlyphQuads = 0;
-
-    int tex_width, tex_height;
+    int tex_width, tex_height, size;
     tex_width = _ftBuffer->font_info[current_font].tex_width;
     tex_height = _ftBuffer->font_info[current_font].tex_height;
+    size = _ftBuffer->font_info[current_font].size;
 
-    static int once = 0;
-    for(int row=0; row<n_rows; row++)
+    for(int col=x0; col<=x1; col++)
     {
+        FTermVertex *verts;
+        verts = _vertexBuffer + 4 * (n_cols * row + col);
+        
+        // cells are placed by column, so any cell can be rebuilt alone
         float xpos, ypos;
+        xpos = size + col * cdata[' '].xadvance;
+        ypos = (row + 1) * size;
         
-        xpos = _ftBuffer->font_info[current_font].size;
-        ypos = (row + 1) * _ftBuffer->font_info[current_font].size;
-
-        for(int col=0; col<n_cols; col++)
+        gp = &_frame.line[_frame.col * row + col];
+        
+        // blinking text is left out while it blinks off
+        if (gp->u >= 32 && gp->u < 128 &&
+            !((gp->mode & ATTR_BLINK) && _frame.blinkoff))
         {
-            gp = &term.line[row][col];
-            
-            if (gp->u >= 32 && gp->u < 128)
+            stbtt_aligned_quad q;
+            stbtt_GetBakedQuad(cdata, tex_width, tex_height,
+                               gp->u, &xpos, &ypos, &q, 1); //1=opengl & d3d10+,0=d3d9
+
+            // stbtt_GetBakedQuad generates degenerate triangles for glyphs that don't render
+            if (q.y0 != q.y1)
             {
-                stbtt_aligned_quad q;
-                stbtt_GetBakedQuad(cdata, tex_width, tex_height,
-                                   gp->u, &xpos, &ypos, &q, 1); //1=opengl & d3d10+,0=d3d9
+                verts[0].position.x = q.x0;
+                verts[0].position.y = q.y0;
+                verts[0].st.x = q.s0;
+                verts[0].st.y = q.t0;
+                
+                verts[1].position.x = q.x1;
+                verts[1].position.y = q.y0;
+                verts[1].st.x = q.s1;
+                verts[1].st.y = q.t0;
+                
+                verts[2].position.x = q.x1;
+                verts[2].position.y = q.y1;
+                verts[2].st.x = q.s1;
+                verts[2].st.y = q.t1;
+                
+                verts[3].position.x = q.x0;
+                verts[3].position.y = q.y1;
+                verts[3].st.x = q.s0;
+                verts[3].st.y = q.t1;
+                continue;
+            }
+        }
+        
+        // a degenerate quad draws nothing
+        memset(verts, 0, 4 * sizeof(FTermVertex));
+    }
+    
+    _dirtyLo = MIN(_dirtyLo, first);
+    _dirtyHi = MAX(_dirtyHi, last);
+}
 
-                // stbtt_GetBakedQuad generates degenerate triangles for glyphs that don't render
-                // so skip them
-                if (q.y0 != q.y1)
-                {
-                    verts[0].position.x = q.x0;
-                    verts[0].position.y = q.y0;
-                    verts[0].st.x = q.s0;
-                    verts[0].st.y = q.t0;
-                    
-                    verts[1].position.x = q.x1;
-                    verts[1].position.y = q.y0;
-                    verts[1].st.x = q.s1;
-                    verts[1].st.y = q.t0;
-                    
-                    verts[2].position.x = q.x1;
-                    verts[2].position.y = q.y1;
-                    verts[2].st.x = q.s1;
-                    verts[2].st.y = q.t1;
-                    
-                    verts[3].position.x = q.x0;
-                    verts[3].position.y = q.y1;
-                    verts[3].st.x = q.s0;
-                    verts[3].st.y = q.t1;
-                    
-                    // quad verts
-                    // 0 --- 1
-                    // |     |
-                    // |     |
-                    // |     |
-                    // 3 --- 2
-                    
-                    // first triangle (0, 1, 3) clockwise
-                    indices[0] = vert_count + 0;
-                    indices[1] = vert_count + 1;
-                    indices[2] = vert_count + 3;
-                    
-                    // second triangle (1, 2, 3) clockwise
-                    indices[3] = vert_count + 1;
-                    indices[4] = vert_count + 2;
-                    indices[5] = vert_count + 3;
-                    
-                    // move pointers forward
-                    verts += 4;
-                    indices += 6;
-                    
-                    // move vert count forward
-                    vert_count += 4;
-                    
-                    // update compiled glyphs to be drawn
-                    _compiledGlyphQuads++;
-                }
+// move the cells and their quads up by n rows, or down by -n, as the terminal scrolled
+- (void)scrollRows:(int)n
+{
+    int n_rows, n_cols, k, size, src, dst;
+    
+    n_rows = _builtRows;
+    n_cols = _builtCols;
+    k = abs(n);
+    size = _ftBuffer->font_info[_ftBuffer->current_font].size;
+    src = (n > 0) ? k : 0;
+    dst = (n > 0) ? 0 : k;
+    
+    memmove(&_ftBuffer->character_buffer[n_cols * dst], &_ftBuffer->character_buffer[n_cols * src],
+            n_cols * (n_rows - k) * sizeof(Glyph));
+    memmove(&_vertexBuffer[4 * n_cols * dst], &_vertexBuffer[4 * n_cols * src],
+            4 * n_cols * (n_rows - k) * sizeof(FTermVertex));
+    
+    // the quads were placed for the rows they came from
+    FTermVertex *verts;
+    verts = &_vertexBuffer[4 * n_cols * dst];
+    for(int i=0; i<4 * n_cols * (n_rows - k); i++)
+    {
+        verts[i].position.y -= n * size;
+    }
+    
+    // the rows coming in are in the damage, everything else moved
+    _dirtyLo = 0;
+    _dirtyHi = n_rows * n_cols - 1;
+}
+
+- (void)processTTYInput
+{
+    int n_rows, n_cols, y;
+    bool full;
+    
+    // the last screen the parser published, only what changed is copied
+    if (!snapread(&_frame) &&
+        _frame.row == _builtRows && _frame.col == _builtCols)
+        return;
+    
+    n_rows = _ftBuffer->rows = _frame.row;
+    n_cols = _ftBuffer->cols = _frame.col;
+    
+    // a new size lays the quads out again
+    full = (n_rows != _builtRows || n_cols != _builtCols);
+    if (full)
+    {
+        [self buildIndices: n_rows * n_cols];
+        _builtRows = n_rows;
+        _builtCols = n_cols;
+        _compiledGlyphQuads = n_rows * n_cols;
+    }
+    else if (_frame.scroll)
+    {
+        [self scrollRows: _frame.scroll];
+    }
+
+    // copy and rebuild only the cells the terminal changed
+    for(y=0; y<n_rows; y++)
+    {
+        if (full)
+            [self updateRow:y from:0 to:n_cols - 1];
+        else if (_frame.damage[y].x0 <= _frame.damage[y].x1)
+            [self updateRow:y from:_frame.damage[y].x0 to:_frame.damage[y].x1];
+    }
+    
+    // a blink leaves the cells as they were, build the blinking ones again
+    if (_frame.blinkoff != _blinkOff)
+    {
+        _blinkOff = _frame.blinkoff;
+        for(y=0; y<n_rows; y++)
+        {
+            for(int x=0; x<n_cols; x++)
+            {
+                if (_frame.line[n_cols * y + x].mode & ATTR_BLINK)
+                    [self updateRow:y from:x to:x];
             }
         }
     }
     
-    once = 1;
+    if (_frame.stylegen != _styleGen)
+    {
+        // only the styles from _frame.stylelo on changed
+        memcpy(&_ftBuffer->styles[_frame.stylelo], &_frame.styles[_frame.stylelo],
+               (_frame.nstyles - _frame.stylelo) * sizeof(Style));
+        _stylesLo = MIN(_stylesLo, _frame.stylelo);
+        _stylesHi = MAX(_stylesHi, _frame.nstyles);
+        _styleGen = _frame.stylegen;
+    }
 }
 
-extern int macos_palette_dirty;
 extern int palette_size;
 extern void getPaletteEntryAsFloats(int index, float *color);
 
 - (void)updatePalette
 {
-    if (macos_palette_dirty)
+    if (_frame.palettegen != _paletteGen)
     {
+        // colors are only set by the parser, rarely, hold it off for the copy
+        pipelock();
         for(int i=0; i<palette_size; i++)
         {
             float rgba[4];
@@ -950,32 +1172,34 @@ extern void getPaletteEntryAsFloats(int index, float *color);
                 //printf("%d: %f, %f, %f, %f\n", i, rgba[0], rgba[1], rgba[2], rgba[3]);
             }
         }
+        pipeunlock();
         
-        macos_palette_dirty = 0;
+        _paletteGen = _frame.palettegen;
     }
 }
 
-// over in macos_support
-extern MacOS_Cursor macos_cursor;
-
 - (void)updateCursor
 {
-    // copy macos cursor Glyph to Glyph used by shader
-    _ftBuffer->cursor.g.mode = macos_cursor.g.mode;
-    _ftBuffer->cursor.g.u = macos_cursor.g.u;
-    _ftBuffer->cursor.g.fg = macos_cursor.g.fg;
-    _ftBuffer->cursor.g.bg = macos_cursor.g.bg;
-    
-    _ftBuffer->cursor.cx = macos_cursor.cx;
-    _ftBuffer->cursor.cy = macos_cursor.cy;
+    // copy the cursor Glyph macos_drawcursor left in the snapshot to the shader
+    _ftBuffer->cursor.g.mode = _frame.cursor.mode;
+    _ftBuffer->cursor.g.u = _frame.cursor.u;
+    _ftBuffer->cursor.g.style = _frame.cursor.style;
+    
+    _ftBuffer->cursor.cx = _frame.cx;
+    _ftBuffer->cursor.cy = _frame.cy;
 }
 
 /// Called whenever the view needs to render a frame.
 - (void)drawInMTKView:(nonnull MTKView *)view
 {
-    // process event queue
+    // process event queue, keys go to the pty without the terminal lock
     [self processEventQueue];
     
+    // the view ticks at its frame rate, the pacing picks the ticks to draw
+    if (!pipeframe() && !_mustDraw)
+        return;
+    _mustDraw = false;
+    
     // process tty input
     [self processTTYInput];
     
@@ -1032,23 +1256,38 @@ extern MacOS_Cursor macos_cursor;
                                       atIndex:i];
         }
         
-        // upload screen buffer information
-        [_gpuFTBuffer didModifyRange: NSMakeRange(0, sizeof(FTermBuffer))];
+        // upload screen buffer information, the styles and cells only where they changed
+        [_gpuFTBuffer didModifyRange: NSMakeRange(0, offsetof(FTermBuffer, styles))];
+        if (_stylesLo < _stylesHi)
+        {
+            [_gpuFTBuffer didModifyRange: NSMakeRange(offsetof(FTermBuffer, styles) + _stylesLo * sizeof(Style),
+                                                      (_stylesHi - _stylesLo) * sizeof(Style))];
+        }
+        if (_dirtyLo <= _dirtyHi)
+        {
+            [_gpuFTBuffer didModifyRange: NSMakeRange(offsetof(FTermBuffer, character_buffer) + _dirtyLo * sizeof(Glyph),
+                                                      (_dirtyHi - _dirtyLo + 1) * sizeof(Glyph))];
+        }
         
         // if there are quads to render..
         if (_compiledGlyphQuads > 0)
         {
-            unsigned vertex_count;
-            vertex_count = _compiledGlyphQuads * 4;
-            
             unsigned index_count;
             index_count = _compiledGlyphQuads * 6;
             
-            // upload updated vertex buffer vertex_count
-            [_gpuVertexBuffer didModifyRange: NSMakeRange(0, sizeof(FTermVertex) * vertex_count)];
+            // upload the quads of the cells updated
+            if (_dirtyLo <= _dirtyHi)
+            {
+                [_gpuVertexBuffer didModifyRange: NSMakeRange(sizeof(FTermVertex) * 4 * _dirtyLo,
+                                                              sizeof(FTermVertex) * 4 * (_dirtyHi - _dirtyLo + 1))];
+            }
             
-            // upload updated element buffer index_count
-            [_gpuElementBuffer didModifyRange: NSMakeRange(0, sizeof(unsigned int) * index_count)];
+            // upload the element buffer when it was laid out again
+            if (_indicesDirty)
+            {
+                [_gpuElementBuffer didModifyRange: NSMakeRange(0, sizeof(unsigned int) * index_count)];
+                _indicesDirty = false;
+            }
             
             // Draw triangles
             [renderEncoder drawIndexedPrimitives: MTLPrimitiveTypeTriangle indexCount: index_count indexType: MTLIndexTypeUInt32 indexBuffer: _gpuElementBuffer indexBufferOffset: 0];
@@ -1057,6 +1296,11 @@ extern MacOS_Cursor macos_cursor;
         
         [renderEncoder endEncoding];
         
+        _dirtyLo = INT_MAX;
+        _dirtyHi = -1;
+        _stylesLo = INT_MAX;
+        _stylesHi = 0;
+        
         // Schedule a present once the framebuffer is complete using the current drawable.
         [commandBuffer presentDrawable:drawable];
     }
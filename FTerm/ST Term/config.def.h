@@ -56,15 +56,22 @@ int allowwindowops = 0;
  * within this range, st draws when content stops arriving (idle). mostly it's
  * near minlatency, but it waits longer for slow updates to avoid partial draw.
  * low minlatency will tear/flicker more, as it can "detect" idle too early.
+ * small updates, like the echo of a key, are drawn at once.
  */
-static double minlatency = 8;
-static double maxlatency = 33;
+double minlatency = 8;
+double maxlatency = 33;
 
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
  */
-static unsigned int blinktimeout = 800;
+unsigned int blinktimeout = 800;
+
+/*
+ * most ms a synchronized update (mode 2026) may hold back the screen before
+ * what was drawn so far is shown anyway.
+ */
+unsigned int synctimeout = 200;
 
 /*
  * thickness of underline and bar cursors
@@ -98,6 +105,26 @@ char *def_termname = "st-256color";
  */
 unsigned int tabspaces = 8;
 
+/*
+ * memory kept for scrollback in bytes, older lines go to disk beyond
+ * it up to histdisk and 0 disables scrollback
+ */
+unsigned int histbytes = 32 << 20;
+
+/*
+ * megabytes of older scrollback kept in files under histdir, TMPDIR
+ * or /tmp when NULL, once histbytes is used up. 0 drops it instead
+ */
+unsigned int histdisk = 0;
+char *histdir = NULL;
+
+/*
+ * most the pty reader takes in one go, in bytes and ms, before the parser
+ * gets to it. Fast producers are read in batches this big, 0 for no limit
+ */
+unsigned int readbudget = 256 << 10;
+unsigned int readbudgetms = 4;
+
 /* Terminal colors (16 first used in escape sequence) */
 static const char *colorname[] = {
 	/* 8 normal colors */
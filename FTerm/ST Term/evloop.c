@@ -0,0 +1,594 @@
+//
+//  evloop.c
+//  FTerm
+//
+//  The loop the pty thread sleeps in, kqueue on macOS and io_uring on
+//  Linux, or epoll where io_uring is missing or turned off. It waits
+//  for the fds it watches, a wakeup from another thread with evwake()
+//  and the next timer, all in one call, so it takes no CPU while
+//  nothing happens and returns as soon as the kernel has bytes for it.
+//  The kernel is only told about an fd when what it is watched for
+//  changes, so a loop that keeps watching the same fds makes one call
+//  per wakeup. With io_uring the polls that changed go to the kernel
+//  in the same call that waits, so it is one call either way.
+//
+//  Timers live on a hierarchical wheel of 1ms ticks, WHEEL_LEVELS of
+//  WHEEL_SLOTS slots each. A timer goes in the lowest level whose span
+//  covers it and moves down a level each time the wheel comes round to
+//  its slot, so arming, stopping and firing cost the same however many
+//  timers there are. Everything but evwake() has to be called from the
+//  thread running evpoll().
+//
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+ #include <sys/event.h>
+#elif defined(__linux__)
+ #include <linux/io_uring.h>
+ #include <poll.h>
+ #include <sys/epoll.h>
+ #include <sys/eventfd.h>
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+#else
+ #error "evloop.c needs kqueue or epoll"
+#endif
+
+#include "st.h"
+#include "evloop.h"
+
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4	/* 2^24 ms, the longest timer is over 4 hours */
+#define EV_WATCHES	8
+#define EV_BATCH	16	/* events taken per wait */
+#define URING_ENTRIES	16	/* submissions queued before a call */
+#define URING_WAKE	UINT64_MAX	/* user_data of the evwake() poll */
+
+typedef struct {
+	int fd;
+	int events;     /* 0 for a free entry */
+	EvFn fn;
+	void *arg;
+	unsigned int gen; /* io_uring: tags the poll armed for it */
+} Watch;
+
+static uint64_t clockms(void);
+static void wheeladd(Timer *);
+static void wheeladvance(uint64_t);
+static int wheelnext(void);
+static void backendwatch(Watch *, int);
+static int backendwait(int, int *, Watch **, int);
+#if defined(__linux__)
+static int uringinit(void);
+static struct io_uring_sqe *uringsqe(void);
+static void uringpoll(int, int, uint64_t);
+static void uringwatch(Watch *, int);
+static int uringwait(int, int *, Watch **, int);
+static void epollwatch(Watch *, int);
+static int epollwait(int, int *, Watch **, int);
+#endif
+
+static Watch watch[EV_WATCHES];
+static Timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t tick;   /* the wheel stands here, fired up to it */
+static int ntimers;
+static atomic_int woken;
+
+#if defined(__APPLE__)
+static int kq = -1;
+#else
+static int ep = -1, wakefd = -1;
+
+/* the rings shared with the kernel, see uringinit() */
+static struct {
+	int fd;
+	_Atomic unsigned int *sqhead, *sqtail, *cqhead, *cqtail;
+	unsigned int sqmask, cqmask, *sqarray, pending;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} ur = { .fd = -1 };
+#endif
+
+void
+evinit(void)
+{
+#if defined(__APPLE__)
+	struct kevent ev;
+
+	if ((kq = kqueue()) < 0)
+		die("kqueue failed: %s\n", strerror(errno));
+	EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		die("kevent failed: %s\n", strerror(errno));
+#else
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		die("eventfd failed: %s\n", strerror(errno));
+	if (uringinit()) {
+		uringpoll(wakefd, EV_READ, URING_WAKE);
+	} else {
+		if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			die("epoll_create1 failed: %s\n", strerror(errno));
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+			die("epoll_ctl failed: %s\n", strerror(errno));
+	}
+#endif
+	tick = clockms();
+}
+
+/*
+ * Calls fn(fd, ready, arg) from evpoll() when fd is ready for any of
+ * events, until it is called again for fd. 0 events stops watching.
+ */
+void
+evwatch(int fd, int events, EvFn fn, void *arg)
+{
+	Watch *w, *spare = NULL;
+
+	for (w = watch; w < watch + EV_WATCHES; w++) {
+		if (w->events && w->fd == fd)
+			break;
+		if (!w->events && !spare)
+			spare = w;
+	}
+	if (w == watch + EV_WATCHES) {
+		if (!events)
+			return;
+		if (!(w = spare))
+			die("evwatch: more than %d fds\n", EV_WATCHES);
+		w->fd = fd;
+	}
+	w->fn = fn;
+	w->arg = arg;
+	if (w->events != events) {
+		backendwatch(w, events);
+		w->events = events;
+	}
+}
+
+/* (re)arms t to call t->fn in ms milliseconds */
+void
+evtimer(Timer *t, unsigned int ms)
+{
+	uint64_t now = clockms();
+
+	evtimerstop(t);
+	/* an idle wheel did not move while the loop slept */
+	if (!ntimers)
+		tick = MAX(tick, now);
+	ms = MAX(ms, 1);
+	ms = MIN(ms, (1U << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+	t->expires = now + ms;
+	wheeladd(t);
+	ntimers++;
+}
+
+void
+evtimerstop(Timer *t)
+{
+	if (!t->pprev)
+		return;
+	if ((*t->pprev = t->next))
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+	ntimers--;
+}
+
+int
+evarmed(const Timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/* makes evpoll() return, from any thread, wakeups before it are merged */
+void
+evwake(void)
+{
+	if (atomic_exchange(&woken, 1))
+		return;
+#if defined(__APPLE__)
+	struct kevent ev;
+
+	EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	kevent(kq, &ev, 1, NULL, 0, NULL);
+#else
+	uint64_t one = 1;
+
+	write(wakefd, &one, sizeof(one));
+#endif
+}
+
+/*
+ * Waits for a watched fd, evwake() or the next timer, then calls the fds
+ * that are ready and the timers that are due.
+ */
+void
+evpoll(void)
+{
+	Watch *w[EV_BATCH];
+	int ready[EV_BATCH];
+	int i, n;
+
+	n = backendwait(wheelnext(), ready, w, EV_BATCH);
+	atomic_store(&woken, 0);
+	for (i = 0; i < n; i++) {
+		/* an earlier callback may have stopped watching it */
+		if (w[i]->events & ready[i])
+			w[i]->fn(w[i]->fd, w[i]->events & ready[i], w[i]->arg);
+	}
+	wheeladvance(clockms());
+}
+
+uint64_t
+clockms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* into the lowest level whose slots are coarse enough for t */
+void
+wheeladd(Timer *t)
+{
+	uint64_t delta = (t->expires > tick) ? t->expires - tick : 0;
+	Timer **slot;
+	int l;
+
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		if (delta < (1ULL << (WHEEL_BITS * (l + 1))))
+			break;
+	}
+	slot = &wheel[l][(t->expires >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1)];
+	if ((t->next = *slot))
+		t->next->pprev = &t->next;
+	*slot = t;
+	t->pprev = slot;
+}
+
+/*
+ * Moves the wheel up to now a tick at a time. A tick where a level comes
+ * round to a slot spreads that slot over the levels below, then the
+ * timers in the level 0 slot of the tick are due.
+ */
+void
+wheeladvance(uint64_t now)
+{
+	Timer *t, **slot;
+	int l;
+
+	if (!ntimers) {
+		tick = MAX(tick, now);
+		return;
+	}
+	while (tick < now) {
+		tick++;
+		for (l = 1; l < WHEEL_LEVELS; l++) {
+			if (tick & ((1ULL << (WHEEL_BITS * l)) - 1))
+				break;
+			slot = &wheel[l][(tick >> (WHEEL_BITS * l)) &
+			                 (WHEEL_SLOTS - 1)];
+			while ((t = *slot)) {
+				*slot = t->next;
+				if (t->next)
+					t->next->pprev = slot;
+				wheeladd(t);
+			}
+		}
+		slot = &wheel[0][tick & (WHEEL_SLOTS - 1)];
+		while ((t = *slot)) {
+			evtimerstop(t);
+			t->fn(t);
+		}
+		if (!ntimers)
+			tick = now;
+	}
+}
+
+/* ms until the next timer is due, -1 when there is none */
+int
+wheelnext(void)
+{
+	uint64_t next = UINT64_MAX, now;
+	Timer *t;
+	int l, s;
+
+	if (!ntimers)
+		return -1;
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		for (s = 0; s < WHEEL_SLOTS; s++) {
+			for (t = wheel[l][s]; t; t = t->next)
+				next = MIN(next, t->expires);
+		}
+	}
+	now = clockms();
+	return (next > now) ? (int)(next - now) : 0;
+}
+
+#if defined(__APPLE__)
+
+void
+backendwatch(Watch *w, int events)
+{
+	struct kevent ev[2];
+	int n = 0;
+
+	if ((w->events ^ events) & EV_READ) {
+		EV_SET(&ev[n++], w->fd, EVFILT_READ,
+		       (events & EV_READ) ? EV_ADD : EV_DELETE, 0, 0, w);
+	}
+	if ((w->events ^ events) & EV_WRITE) {
+		EV_SET(&ev[n++], w->fd, EVFILT_WRITE,
+		       (events & EV_WRITE) ? EV_ADD : EV_DELETE, 0, 0, w);
+	}
+	if (kevent(kq, ev, n, NULL, 0, NULL) < 0)
+		die("kevent failed: %s\n", strerror(errno));
+}
+
+int
+backendwait(int timeout, int *ready, Watch **w, int max)
+{
+	struct kevent ev[EV_BATCH];
+	struct timespec ts, *tp = NULL;
+	int i, k, n;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tp = &ts;
+	}
+	if ((n = kevent(kq, NULL, 0, ev, MIN(max, EV_BATCH), tp)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		die("kevent failed: %s\n", strerror(errno));
+	}
+	for (i = k = 0; i < n; i++) {
+		if (ev[i].filter == EVFILT_USER)
+			continue;
+		w[k] = ev[i].udata;
+		ready[k++] = (ev[i].filter == EVFILT_READ) ? EV_READ : EV_WRITE;
+	}
+	return k;
+}
+
+#else
+
+void
+backendwatch(Watch *w, int events)
+{
+	if (ur.fd >= 0)
+		uringwatch(w, events);
+	else
+		epollwatch(w, events);
+}
+
+int
+backendwait(int timeout, int *ready, Watch **w, int max)
+{
+	if (ur.fd >= 0)
+		return uringwait(timeout, ready, w, max);
+	return epollwait(timeout, ready, w, max);
+}
+
+/*
+ * Sets up io_uring, 0 when the kernel does not have it, is too old for
+ * waits with a timeout (5.11) or has it turned off.
+ */
+int
+uringinit(void)
+{
+	struct io_uring_params p = { 0 };
+	size_t sqlen, cqlen;
+	char *sq, *cq;
+
+	if ((ur.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		return 0;
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqlen = cqlen = MAX(sqlen, cqlen);
+	sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE,
+		          MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	ur.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               ur.fd, IORING_OFF_SQES);
+	if (ur.sqes == MAP_FAILED)
+		goto fail;
+
+	ur.sqhead = (void *)(sq + p.sq_off.head);
+	ur.sqtail = (void *)(sq + p.sq_off.tail);
+	ur.sqmask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ur.sqarray = (void *)(sq + p.sq_off.array);
+	ur.cqhead = (void *)(cq + p.cq_off.head);
+	ur.cqtail = (void *)(cq + p.cq_off.tail);
+	ur.cqmask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ur.cqes = (void *)(cq + p.cq_off.cqes);
+	return 1;
+
+fail:
+	/* the mappings go with the fd */
+	close(ur.fd);
+	ur.fd = -1;
+	return 0;
+}
+
+/* the next free submission, zeroed, submitting the queue when it is full */
+struct io_uring_sqe *
+uringsqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	while (ur.pending > ur.sqmask) {
+		if (syscall(__NR_io_uring_enter, ur.fd, ur.pending, 0, 0,
+		            NULL, 0) < 0 && errno != EINTR)
+			die("io_uring_enter failed: %s\n", strerror(errno));
+		ur.pending = atomic_load_explicit(ur.sqtail,
+		                                  memory_order_relaxed) -
+		             atomic_load_explicit(ur.sqhead,
+		                                  memory_order_acquire);
+	}
+	tail = atomic_load_explicit(ur.sqtail, memory_order_relaxed);
+	sqe = &ur.sqes[tail & ur.sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	ur.sqarray[tail & ur.sqmask] = tail & ur.sqmask;
+	atomic_store_explicit(ur.sqtail, tail + 1, memory_order_release);
+	ur.pending++;
+	return sqe;
+}
+
+/*
+ * Queues a one shot poll of fd. A multishot poll only reports new
+ * wakeups, while the reader may leave bytes behind for its budget, so
+ * each completion arms the next poll, which is submitted with the wait.
+ */
+void
+uringpoll(int fd, int events, uint64_t tag)
+{
+	struct io_uring_sqe *sqe = uringsqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = ((events & EV_READ) ? POLLIN : 0) |
+	                     ((events & EV_WRITE) ? POLLOUT : 0);
+	sqe->user_data = tag;
+}
+
+/* the tag of w's poll, completions of earlier ones no longer match */
+#define URING_TAG(w)	((uint64_t)((w) - watch + 1) << 32 | (w)->gen)
+
+void
+uringwatch(Watch *w, int events)
+{
+	struct io_uring_sqe *sqe;
+
+	if (w->events) {
+		sqe = uringsqe();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = URING_TAG(w);
+		sqe->user_data = 0;
+	}
+	w->gen++;
+	if (events)
+		uringpoll(w->fd, events, URING_TAG(w));
+}
+
+int
+uringwait(int timeout, int *ready, Watch **w, int max)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg = { 0 };
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	uint64_t drain;
+	Watch *p;
+	int k, r;
+
+	head = atomic_load_explicit(ur.cqhead, memory_order_relaxed);
+	tail = atomic_load_explicit(ur.cqtail, memory_order_acquire);
+	if (head == tail || ur.pending) {
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+		/* submit what changed and, with nothing to reap, wait */
+		r = syscall(__NR_io_uring_enter, ur.fd, ur.pending,
+		            head == tail, IORING_ENTER_GETEVENTS |
+		            IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (r < 0 && errno != EINTR && errno != ETIME)
+			die("io_uring_enter failed: %s\n", strerror(errno));
+		ur.pending = atomic_load_explicit(ur.sqtail,
+		                                  memory_order_relaxed) -
+		             atomic_load_explicit(ur.sqhead,
+		                                  memory_order_acquire);
+		tail = atomic_load_explicit(ur.cqtail, memory_order_acquire);
+	}
+
+	for (k = 0; head != tail && k < max; head++) {
+		cqe = &ur.cqes[head & ur.cqmask];
+		if (cqe->user_data == URING_WAKE) {
+			read(wakefd, &drain, sizeof(drain));
+			uringpoll(wakefd, EV_READ, URING_WAKE);
+			continue;
+		}
+		if (cqe->user_data == 0)
+			continue;
+		p = &watch[(cqe->user_data >> 32) - 1];
+		if (!p->events || cqe->user_data != URING_TAG(p))
+			continue;
+		uringpoll(p->fd, p->events, URING_TAG(p));
+		if (cqe->res < 0)
+			continue;
+		w[k] = p;
+		/* a hangup or an error is for the read to find */
+		ready[k++] = ((cqe->res & (POLLIN | POLLHUP | POLLERR)) ?
+		              EV_READ : 0) |
+		             ((cqe->res & POLLOUT) ? EV_WRITE : 0);
+	}
+	atomic_store_explicit(ur.cqhead, head, memory_order_release);
+	return k;
+}
+
+void
+epollwatch(Watch *w, int events)
+{
+	struct epoll_event ev = { .data.ptr = w };
+	int op;
+
+	ev.events = ((events & EV_READ) ? EPOLLIN : 0) |
+	            ((events & EV_WRITE) ? EPOLLOUT : 0);
+	op = !w->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL
+	                                          : EPOLL_CTL_MOD;
+	if (epoll_ctl(ep, op, w->fd, &ev) < 0)
+		die("epoll_ctl failed: %s\n", strerror(errno));
+}
+
+int
+epollwait(int timeout, int *ready, Watch **w, int max)
+{
+	struct epoll_event ev[EV_BATCH];
+	uint64_t drain;
+	int i, k, n;
+
+	if ((n = epoll_wait(ep, ev, MIN(max, EV_BATCH), timeout)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		die("epoll_wait failed: %s\n", strerror(errno));
+	}
+	for (i = k = 0; i < n; i++) {
+		if (ev[i].data.ptr == NULL) {
+			read(wakefd, &drain, sizeof(drain));
+			continue;
+		}
+		w[k] = ev[i].data.ptr;
+		/* a hangup or an error is for the read to find */
+		ready[k++] = ((ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ?
+		              EV_READ : 0) |
+		             ((ev[i].events & EPOLLOUT) ? EV_WRITE : 0);
+	}
+	return k;
+}
+
+#endif
@@ -0,0 +1,36 @@
+//
+//  evloop.h
+//  FTerm
+//
+//  Event loop of the pty thread, fds and timers, see evloop.c
+//
+
+#ifndef evloop_h
+#define evloop_h
+
+#include <stdint.h>
+
+enum {
+	EV_READ  = 1 << 0,
+	EV_WRITE = 1 << 1
+};
+
+typedef struct Timer Timer;
+struct Timer {
+	void (*fn)(Timer *);
+	uint64_t expires;   /* ms tick it is due at */
+	Timer *next;
+	Timer **pprev;      /* NULL when it is not armed */
+};
+
+typedef void (*EvFn)(int, int, void *);
+
+void evinit(void);
+void evwatch(int, int, EvFn, void *);
+void evtimer(Timer *, unsigned int);
+void evtimerstop(Timer *);
+int evarmed(const Timer *);
+void evwake(void);
+void evpoll(void);
+
+#endif /* evloop_h */
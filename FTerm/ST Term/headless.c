@@ -0,0 +1,249 @@
+//
+//  headless.c
+//  FTerm
+//
+//  Runs the pipeline without the app: a child on a pty writes a known
+//  screen, pipestart() reads and parses it on its own threads and the
+//  snapshot the renderer would draw is checked. The snapshot is read
+//  all along, as the renderer does, so the rows it moves when the
+//  screen scrolls are checked too, and again with the view scrolled
+//  back into the history. Not part of the Xcode target, build it with
+//  the Makefile next to it.
+//
+
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#if   defined(__linux)
+ #include <pty.h>
+#elif defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+ #include <util.h>
+#elif defined(__FreeBSD__) || defined(__DragonFly__)
+ #include <libutil.h>
+#endif
+
+#include "st.h"
+#include "st_types.h"
+#include "macos_support.h"
+#include "pipeline.h"
+#include "snap.h"
+#include "config.def.h"
+
+#define FLOOD		20000	/* lines written at once */
+#define TRICKLE		200	/* lines written a few at a time after */
+#define TIMEOUT		10000	/* ms the screen has to show up */
+
+static void produce(void);
+static void put(const char *, size_t);
+static int check(Frame *, int, int);
+static int rowis(Frame *, int, const char *);
+static int same(Frame *);
+
+/*
+ * The child: enough lines to grow the ring, then lines slow enough for
+ * the screen to be read between scrolls of a few rows, then two lines
+ * with colors over the top of what they left, then a cursor report it
+ * asks the terminal for and writes back out.
+ */
+void
+produce(void)
+{
+	char buf[64];
+	struct termios t;
+	size_t n;
+	int i;
+
+	tcgetattr(0, &t);
+	cfmakeraw(&t);
+	tcsetattr(0, TCSANOW, &t);
+
+	for (i = 0; i < FLOOD + TRICKLE; i++) {
+		n = snprintf(buf, sizeof(buf), "flood %d\r\n", i);
+		put(buf, n);
+		if (i >= FLOOD && i % 3 == 0)
+			usleep(2000);
+	}
+	put("\033[Hhello \033[31mred\033[m\033[K", 27);
+	put("\033[6n", 4);
+	for (n = 0; n < sizeof(buf) - 1; n++) {
+		if (read(0, buf + n, 1) != 1)
+			_exit(1);
+		if (buf[n] == '\033')
+			buf[n] = '^';
+		if (buf[n] == 'R')
+			break;
+	}
+	put("\r\nreply ", 8);
+	put(buf, n + 1);
+	put("\033[K", 3);
+	pause();
+	_exit(0);
+}
+
+void
+put(const char *s, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(1, s, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+		s += r;
+		n -= r;
+	}
+}
+
+/*
+ * whether the frame shows the child's screen below scr lines of the
+ * history, telling why not when loud
+ */
+int
+check(Frame *f, int scr, int loud)
+{
+	Style *red;
+	char buf[32];
+	int y, sy;
+
+	/* the history and the screen are one run of lines but for two */
+	for (y = 0; y < f->row; y++) {
+		sy = y - scr;
+		if (sy == 0 || sy == 1)
+			continue;
+		if (sy == f->row - 1)
+			buf[0] = '\0';
+		else
+			snprintf(buf, sizeof(buf), "flood %d",
+			         FLOOD + TRICKLE - f->row + 1 + sy);
+		if (!rowis(f, y, buf))
+			break;
+	}
+	if (y < f->row ||
+	    (scr < f->row && !rowis(f, scr, "hello red")) ||
+	    (scr + 1 < f->row && !rowis(f, scr + 1, "reply ^[1;10R"))) {
+		if (loud)
+			fprintf(stderr, "headless: wrong text on the screen\n");
+		return 0;
+	}
+	if (f->scr != scr) {
+		if (loud)
+			fprintf(stderr, "headless: %d lines of history shown\n",
+			        f->scr);
+		return 0;
+	}
+	/* the rest is out of view */
+	if (scr + 1 >= f->row)
+		return 1;
+	red = &f->styles[f->line[scr * f->col + 6].style];
+	if (red->fg != 1 ||
+	    f->styles[f->line[scr * f->col].style].fg != defaultfg) {
+		if (loud)
+			fprintf(stderr, "headless: wrong colors\n");
+		return 0;
+	}
+	if (f->cx != 13 || f->cy != 1 + scr) {
+		if (loud)
+			fprintf(stderr, "headless: cursor at %d,%d\n",
+			        f->cx, f->cy);
+		return 0;
+	}
+	return 1;
+}
+
+/* what was kept up to date has to be what a first read gets */
+int
+same(Frame *f)
+{
+	Frame g;
+	int r;
+
+	memset(&g, 0, sizeof(g));
+	snapread(&g);
+	r = g.gen == f->gen &&
+	    !memcmp(g.line, f->line, f->row * f->col * sizeof(*f->line));
+	if (!r)
+		fprintf(stderr, "headless: the frame read along differs\n");
+	snapfree(&g);
+	return r;
+}
+
+/* row y holds s and blanks after it */
+int
+rowis(Frame *f, int y, const char *s)
+{
+	Glyph *g = &f->line[y * f->col];
+	int x;
+
+	for (x = 0; x < f->col; x++) {
+		if (g[x].u != (*s ? (Rune)*s++ : ' '))
+			return 0;
+	}
+	return 1;
+}
+
+int
+main(void)
+{
+	/* lines to scroll the view back by, forward when negative */
+	static const int moves[] = { 3, 5, -2, 100, -30, -5, -INT_MAX };
+	struct winsize ws = { 0 };
+	struct timespec start, now;
+	Frame f;
+	pid_t pid;
+	int i, m, ok, scr;
+
+	setlocale(LC_CTYPE, "");
+	tnew(cols, rows);
+	selinit();
+	ws.ws_col = cols;
+	ws.ws_row = rows;
+
+	if ((pid = forkpty(&m, NULL, NULL, &ws)) < 0)
+		die("forkpty failed: %s\n", strerror(errno));
+	if (pid == 0)
+		produce();
+	pipestart(m);
+
+	memset(&f, 0, sizeof(f));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		usleep(1000);
+		snapread(&f);
+		ok = check(&f, 0, 0);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (!ok && TIMEDIFF(now, start) < TIMEOUT);
+
+	/* the child goes with the pty, killing it makes the reader die() */
+	if (!ok) {
+		check(&f, 0, 1);
+		return 1;
+	}
+	if (!same(&f))
+		return 1;
+
+	/* the history the screen scrolled into, read along as it moves */
+	for (i = scr = 0; i < LEN(moves); i++) {
+		pipelock();
+		if (moves[i] > 0)
+			kscrollup(&(Arg){ .i = moves[i] });
+		else
+			kscrolldown(&(Arg){ .i = -moves[i] });
+		pipeunlock();
+		scr = MAX(scr + moves[i], 0);
+		snapread(&f);
+		if (!check(&f, scr, 1) || !same(&f))
+			return 1;
+	}
+	printf("headless: ok\n");
+	return 0;
+}
@@ -0,0 +1,970 @@
+//
+//  hist.c
+//  FTerm
+//
+//  Scrollback history. Lines scrolled off the top of the screen are
+//  appended to blocks of HIST_BLOCK lines. The newest HIST_HOT blocks
+//  keep their lines as Glyphs, older blocks are packed into runs of
+//  equal attributes and compressed. Beyond histbytes the oldest cold
+//  blocks are appended to segment files and mapped back when read,
+//  beyond histdisk whole blocks are dropped from the old end. The
+//  writes are queued for a thread of their own, the parser does not
+//  wait on the disk unless SPILL_QUEUE blocks are still waiting. Every
+//  cold block keeps a bitmap of the trigrams in its lines, sized by how
+//  many it has, searches skip the blocks missing any trigram of the
+//  pattern.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "hist.h"
+
+#define HIST_BLOCK	64	/* lines per block */
+#define HIST_HOT	4	/* newest blocks kept as Glyphs */
+#define SEG_MAX		(16 << 20)	/* bytes per segment file */
+#define SIG_SHIFT	16		/* trigram hash bits counted, at most */
+#define SIG_PER		4		/* bitmap bits per distinct trigram */
+#define SPILL_QUEUE	64		/* blocks waiting to be written */
+#define TRIHASH(a, b, c) \
+	((((a) * 0x9e3779b1u ^ (b)) * 0x85ebca77u ^ (c)) * 0xc2b2ae3du)
+#define PACK_BOUND(n, c)	(((n) + (c)->off[n]) * 25)
+#define LZ_HASHBITS	12
+#define LZ_MINMATCH	4
+#define LZ_BOUND(n)	((n) + (n) / 255 + 16)
+
+#define BLK(i)		hist.blk[(hist.head + (i)) % hist.blksiz]
+
+typedef struct {
+	uint off[HIST_BLOCK + 1]; /* first cell of every line in cells */
+	Glyph *cells;             /* lines, each followed by its fill */
+	size_t cellsiz;           /* allocated cells */
+} HistCells;
+
+typedef struct {
+	int fd;
+	size_t len;     /* bytes written */
+	uchar *map;     /* SEG_MAX bytes mapped on the first read */
+	int live;       /* blocks still stored here */
+} Segment;
+
+typedef struct {
+	int n;            /* lines in the block */
+	HistCells *hot;   /* lines of a hot block */
+	uchar *data;      /* lines of a cold block, packed and compressed */
+	Segment *seg;     /* where data went once spilled to disk */
+	size_t segoff;
+	size_t len;       /* bytes of data */
+	size_t rawlen;    /* bytes of data once decompressed */
+	size_t rawcells;  /* cells of the lines as pushed */
+	uint64_t *sig;    /* trigrams of a cold block, by their top bits */
+	int sigshift;     /* the bitmap has 1 << sigshift bits */
+} HistBlock;
+
+typedef struct {
+	HistBlock **blk;  /* ring of blocks, oldest first */
+	int head;         /* slot of the oldest block */
+	int nblk;         /* blocks in use */
+	int blksiz;       /* allocated slots */
+	int spilled;      /* oldest blocks whose data is on disk */
+	Segment **seg;    /* segment files, oldest first */
+	int nseg;
+	int nodisk;       /* set once writing a segment failed */
+	size_t lines;     /* lines in all blocks */
+	size_t hot;       /* bytes of hot cells */
+	size_t cold;      /* bytes of cold data in memory */
+	size_t disk;      /* bytes of segment files */
+	size_t sig;       /* bytes of trigram bitmaps */
+	size_t rawcells;  /* cells of all lines as pushed */
+	size_t dropped;   /* lines dropped for the budget */
+	size_t thawed;    /* cold blocks decoded */
+	HistBlock *cache; /* cold block currently decoded in dec */
+	HistCells dec;
+	HistCells *spare; /* cells of the last frozen block, for reuse */
+} History;
+
+/* a block on its way to disk, its data stays in memory until reaped */
+typedef struct {
+	HistBlock *b;
+	const uchar *data;
+	size_t len;
+	int fd;
+	size_t off;
+	int err;          /* errno of the write, set by the writer */
+} SpillWrite;
+
+/*
+ * The queue of the writer thread. The parser adds at tail and reaps up
+ * to done, the writer writes up to tail and moves done, under lock.
+ */
+typedef struct {
+	SpillWrite q[SPILL_QUEUE];
+	uint64_t tail, done, reaped;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t more;  /* tail moved */
+	pthread_cond_t wrote; /* done moved */
+} SpillQueue;
+
+static void histdrop(void);
+static void histfreeze(int);
+static size_t histmem(void);
+static HistBlock *histnewblock(void);
+static size_t histpack(const HistBlock *, uchar *);
+static void histsig(int);
+static int histspill(void);
+static void *spillloop(void *);
+static void spillreap(int);
+static HistCells *histthaw(size_t);
+static void histtrim(void);
+static void histunpack(const uchar *, const uchar *, HistCells *);
+static const uchar *segread(const HistBlock *);
+static void segfree(Segment *);
+static Segment *segnew(void);
+static int sigline(uint64_t *, const HistCells *, int, Rune *, int *,
+                   int *);
+static void cellsreserve(HistCells *, size_t);
+static uchar *scratch(uchar **, size_t *, size_t);
+static uchar *putvar(uchar *, uint32_t);
+static const uchar *getvar(const uchar *, uint32_t *);
+static size_t lzpack(const uchar *, size_t, uchar *);
+static size_t lzunpack(const uchar *, size_t, uchar *);
+
+static History hist;
+static SpillQueue spill = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.more = PTHREAD_COND_INITIALIZER,
+	.wrote = PTHREAD_COND_INITIALIZER,
+};
+
+void
+histpush(const Glyph *line, int col)
+{
+	HistBlock *b;
+	HistCells *c;
+	Glyph fill;
+	int len;
+
+	if (histbytes == 0 || col <= 0)
+		return;
+
+	/* trailing blanks are kept once, as the fill of the line */
+	fill = line[col-1];
+	if (fill.u == ' ' &&
+	    !(fill.mode & (ATTR_WIDE|ATTR_WDUMMY|ATTR_WRAP))) {
+		for (len = col; len > 0 && line[len-1].u == ' ' &&
+		     !ATTRCMP(line[len-1], fill); len--)
+			;
+	} else {
+		fill = (Glyph){ .u = ' ', .style = styleid(defaultfg, defaultbg) };
+		len = col;
+	}
+
+	if (hist.nblk == 0 || BLK(hist.nblk-1)->n == HIST_BLOCK)
+		b = histnewblock();
+	else
+		b = BLK(hist.nblk-1);
+
+	c = b->hot;
+	cellsreserve(c, c->off[b->n] + len + 1);
+	memcpy(&c->cells[c->off[b->n]], line, len * sizeof(Glyph));
+	c->cells[c->off[b->n] + len] = fill;
+	c->off[b->n + 1] = c->off[b->n] + len + 1;
+	b->n++;
+	b->rawcells += col;
+	hist.rawcells += col;
+	hist.lines++;
+
+	histtrim();
+}
+
+int
+histlines(void)
+{
+	return hist.lines;
+}
+
+/*
+ * Copy line n of the history, 0 being the newest, into dst cut or
+ * padded to col cells. Returns 0 if there is no such line.
+ */
+int
+histline(int n, Glyph *dst, int col)
+{
+	HistCells *c;
+	const Glyph *gp;
+	size_t i;
+	int len, x;
+
+	if (n < 0 || (size_t)n >= hist.lines || col <= 0)
+		return 0;
+
+	/* only the newest block can be partly filled */
+	i = hist.lines - 1 - n;
+	if ((c = BLK(i / HIST_BLOCK)->hot) == NULL &&
+	    (c = histthaw(i / HIST_BLOCK)) == NULL)
+		return 0;
+	i %= HIST_BLOCK;
+
+	gp = &c->cells[c->off[i]];
+	len = c->off[i+1] - c->off[i] - 1;
+	memcpy(dst, gp, MIN(len, col) * sizeof(Glyph));
+	for (x = len; x < col; x++)
+		dst[x] = gp[len];
+	if (dst[col-1].mode & ATTR_WIDE) {
+		dst[col-1].u = ' ';
+		dst[col-1].mode &= ~ATTR_WIDE;
+	}
+	return 1;
+}
+
+void
+histclear(void)
+{
+	while (hist.nblk > 0)
+		histdrop();
+	hist.dropped = 0;
+}
+
+void
+histstat(HistStat *st)
+{
+	st->lines = hist.lines;
+	st->blocks = hist.nblk;
+	st->hot = hist.hot + hist.dec.cellsiz * sizeof(Glyph);
+	st->cold = hist.cold;
+	st->disk = hist.disk;
+	st->index = histmem() - st->hot - hist.cold;
+	st->raw = hist.rawcells * sizeof(Glyph);
+	st->dropped = hist.dropped;
+	st->thawed = hist.thawed;
+}
+
+/*
+ * Mark the styles of hot and decoded cells in used. Cold blocks keep
+ * their colors, not styles. All allocated cells are looked at, the
+ * ones not holding a line yet are zeroed or left from older lines.
+ */
+void
+histmark(uchar *used)
+{
+	const HistCells *c;
+	const Glyph *gp;
+	int i;
+
+	for (i = MAX(hist.nblk - HIST_HOT, 0); i < hist.nblk; i++) {
+		c = BLK(i)->hot;
+		for (gp = c->cells; gp < &c->cells[c->cellsiz]; gp++)
+			used[gp->style] = 1;
+	}
+	for (gp = hist.dec.cells; gp < &hist.dec.cells[hist.dec.cellsiz]; gp++)
+		used[gp->style] = 1;
+}
+
+/*
+ * Hash the trigrams of the first HIST_SEARCHMAX runes of pat. Patterns
+ * of less than 3 runes leave q empty and match every block.
+ */
+void
+histquery(HistQuery *q, const Rune *pat, int len)
+{
+	int i;
+
+	len = MIN(len, HIST_SEARCHMAX);
+	for (q->n = 0, i = 2; i < len; i++)
+		q->bit[q->n++] = TRIHASH(pat[i-2], pat[i-1], pat[i]);
+}
+
+/*
+ * Returns the first line from n on, going to older lines for dir > 0
+ * and newer ones otherwise, where a match of q may start or -1 if
+ * there is none.
+ */
+int
+histskip(int n, int dir, const HistQuery *q)
+{
+	HistBlock *b;
+	size_t i;
+	uint h;
+	int k;
+
+	while (n >= 0 && (size_t)n < hist.lines) {
+		i = hist.lines - 1 - n;
+		b = BLK(i / HIST_BLOCK);
+		if (b->hot)
+			return n;
+		for (k = 0; k < q->n; k++) {
+			h = q->bit[k] >> (32 - b->sigshift);
+			if (!(b->sig[h >> 6] >> (h & 63) & 1))
+				break;
+		}
+		if (k == q->n)
+			return n;
+
+		i -= i % HIST_BLOCK;
+		n = dir > 0 ? hist.lines - i : hist.lines - 1 - i - HIST_BLOCK;
+	}
+	return -1;
+}
+
+size_t
+histmem(void)
+{
+	return hist.hot + hist.cold + hist.dec.cellsiz * sizeof(Glyph) +
+	       hist.sig + hist.blksiz * sizeof(HistBlock *) +
+	       hist.nblk * sizeof(HistBlock) +
+	       hist.nseg * (sizeof(Segment) + sizeof(Segment *));
+}
+
+/* spill cold blocks to disk, then drop blocks, to stay within budget */
+void
+histtrim(void)
+{
+	while (histmem() > histbytes && hist.nblk > 1) {
+		if (!histspill())
+			histdrop();
+	}
+	while (hist.disk > (size_t)histdisk << 20 && hist.spilled > 0)
+		histdrop();
+}
+
+HistBlock *
+histnewblock(void)
+{
+	HistBlock **blk, *b;
+	int i, siz;
+
+	if (hist.nblk == hist.blksiz) {
+		siz = hist.blksiz ? hist.blksiz * 2 : 16;
+		blk = xmalloc(siz * sizeof(*blk));
+		for (i = 0; i < hist.nblk; i++)
+			blk[i] = BLK(i);
+		free(hist.blk);
+		hist.blk = blk;
+		hist.blksiz = siz;
+		hist.head = 0;
+	}
+
+	b = xmalloc(sizeof(*b));
+	memset(b, 0, sizeof(*b));
+	if (hist.spare) {
+		b->hot = hist.spare;
+		hist.spare = NULL;
+	} else {
+		b->hot = xmalloc(sizeof(HistCells));
+		memset(b->hot, 0, sizeof(HistCells));
+		hist.hot += sizeof(HistCells);
+		cellsreserve(b->hot, HIST_BLOCK * 16);
+	}
+	BLK(hist.nblk) = b;
+	hist.nblk++;
+
+	if (hist.nblk > HIST_HOT)
+		histfreeze(hist.nblk - 1 - HIST_HOT);
+	return b;
+}
+
+void
+histdrop(void)
+{
+	HistBlock *b = BLK(0);
+
+	/* its data may still be read by the writer */
+	if (b->seg && b->data)
+		spillreap(1);
+	if (hist.cache == b)
+		hist.cache = NULL;
+	if (b->hot) {
+		hist.hot -= b->hot->cellsiz * sizeof(Glyph) + sizeof(HistCells);
+		free(b->hot->cells);
+		free(b->hot);
+	}
+	if (b->data)
+		hist.cold -= b->len;
+	free(b->data);
+	if (b->seg) {
+		hist.spilled--;
+		/* segments empty in the order they were written */
+		if (--b->seg->live == 0) {
+			segfree(b->seg);
+			memmove(hist.seg, hist.seg + 1,
+			        --hist.nseg * sizeof(*hist.seg));
+		}
+	}
+	if (b->sig)
+		hist.sig -= (1 << b->sigshift) / 8;
+	free(b->sig);
+	hist.lines -= b->n;
+	hist.rawcells -= b->rawcells;
+	hist.dropped += b->n;
+	free(b);
+
+	hist.head = (hist.head + 1) % hist.blksiz;
+	hist.nblk--;
+}
+
+/* turn hot block i into a cold one */
+void
+histfreeze(int i)
+{
+	static uchar *raw, *lz;
+	static size_t rawsiz, lzsiz;
+	HistBlock *b = BLK(i);
+
+	histsig(i);
+	scratch(&raw, &rawsiz, PACK_BOUND(b->n, b->hot));
+	b->rawlen = histpack(b, raw);
+	scratch(&lz, &lzsiz, LZ_BOUND(b->rawlen));
+	b->len = lzpack(raw, b->rawlen, lz);
+	b->data = xmalloc(b->len);
+	memcpy(b->data, lz, b->len);
+	hist.cold += b->len;
+
+	/* a new block is about to need the same room */
+	if (hist.spare == NULL) {
+		hist.spare = b->hot;
+	} else {
+		hist.hot -= b->hot->cellsiz * sizeof(Glyph) + sizeof(HistCells);
+		free(b->hot->cells);
+		free(b->hot);
+	}
+	b->hot = NULL;
+}
+
+/*
+ * Build the trigram bitmap of block i. A match starting in its last
+ * line may go on into the lines the line wraps into, their first runes
+ * are added too; blocks after i are still hot. The trigrams are set in
+ * 1 << SIG_SHIFT bits first, the bitmap kept has about SIG_PER bits
+ * for each of them so it is as selective for long lines as for short.
+ */
+void
+histsig(int i)
+{
+	static uint64_t all[(1 << SIG_SHIFT) / 64];
+	HistBlock *b = BLK(i), *blk = b;
+	Rune w[2];
+	uint64_t m;
+	uint h;
+	int k, l, n, nw = 0, max = INT_MAX, wrap = 0;
+
+	memset(all, 0, sizeof(all));
+	for (l = 0; l < b->n; l++)
+		wrap = sigline(all, b->hot, l, w, &nw, &max);
+
+	for (max = HIST_SEARCHMAX; wrap && max > 0 && ++i < hist.nblk; ) {
+		b = BLK(i);
+		for (l = 0; wrap && max > 0 && l < b->n; l++)
+			wrap = sigline(all, b->hot, l, w, &nw, &max);
+	}
+
+	for (n = k = 0; k < LEN(all); k++)
+		n += __builtin_popcountll(all[k]);
+	for (blk->sigshift = 6; blk->sigshift < SIG_SHIFT &&
+	     (1 << blk->sigshift) < n * SIG_PER; blk->sigshift++)
+		;
+	blk->sig = xmalloc((1 << blk->sigshift) / 8);
+	memset(blk->sig, 0, (1 << blk->sigshift) / 8);
+	hist.sig += (1 << blk->sigshift) / 8;
+
+	/* the top bits of a hash are the top bits of its place in all */
+	for (k = 0; k < LEN(all); k++) {
+		for (m = all[k]; m; m &= m - 1) {
+			h = (k * 64 + __builtin_ctzll(m)) >>
+			    (SIG_SHIFT - blk->sigshift);
+			blk->sig[h >> 6] |= (uint64_t)1 << (h & 63);
+		}
+	}
+}
+
+/*
+ * Give the data of the oldest cold block not spilled yet a place at the
+ * end of the newest segment and queue it for the writer. It counts as
+ * on disk from now on, but stays in memory for reads until reaped.
+ * Returns 0 if there is no such block or no segment for it.
+ */
+int
+histspill(void)
+{
+	pthread_attr_t attr;
+	pthread_t t;
+	HistBlock *b;
+	Segment *s;
+
+	if (histdisk == 0 || hist.nodisk ||
+	    hist.spilled >= hist.nblk - HIST_HOT)
+		return 0;
+	b = BLK(hist.spilled);
+
+	s = hist.nseg ? hist.seg[hist.nseg-1] : NULL;
+	if (s == NULL || s->len + b->len > SEG_MAX) {
+		if ((s = segnew()) == NULL) {
+			hist.nodisk = 1;
+			return 0;
+		}
+	}
+	if (!spill.started) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&t, &attr, spillloop, NULL) != 0)
+			die("pthread_create failed: %s\n", strerror(errno));
+		pthread_attr_destroy(&attr);
+		spill.started = 1;
+	}
+
+	b->seg = s;
+	b->segoff = s->len;
+	s->len += b->len;
+	s->live++;
+	hist.disk += b->len;
+	hist.cold -= b->len;
+	hist.spilled++;
+
+	/* a full queue waits for the disk, else only what is done is taken */
+	spillreap(spill.tail - spill.reaped == SPILL_QUEUE);
+	pthread_mutex_lock(&spill.lock);
+	spill.q[spill.tail % SPILL_QUEUE] =
+		(SpillWrite){ b, b->data, b->len, s->fd, b->segoff, 0 };
+	spill.tail++;
+	pthread_cond_signal(&spill.more);
+	pthread_mutex_unlock(&spill.lock);
+	return 1;
+}
+
+/*
+ * Free the data of the blocks written, after all queued ones were when
+ * sync is set. A block that could not be written keeps its data, no
+ * more are spilled.
+ */
+void
+spillreap(int sync)
+{
+	SpillWrite *w;
+	uint64_t done;
+
+	pthread_mutex_lock(&spill.lock);
+	while (sync && spill.done != spill.tail)
+		pthread_cond_wait(&spill.wrote, &spill.lock);
+	done = spill.done;
+	pthread_mutex_unlock(&spill.lock);
+
+	for (; spill.reaped < done; spill.reaped++) {
+		w = &spill.q[spill.reaped % SPILL_QUEUE];
+		if (w->err) {
+			fprintf(stderr, "histspill: %s\n", strerror(w->err));
+			hist.nodisk = 1;
+			hist.cold += w->len;
+			continue;
+		}
+		free(w->b->data);
+		w->b->data = NULL;
+	}
+}
+
+/* the writer thread, takes the queued blocks in order */
+void *
+spillloop(void *arg)
+{
+	SpillWrite *w;
+	size_t off;
+	ssize_t r;
+
+	pthread_mutex_lock(&spill.lock);
+	for (;;) {
+		while (spill.done == spill.tail)
+			pthread_cond_wait(&spill.more, &spill.lock);
+		w = &spill.q[spill.done % SPILL_QUEUE];
+		pthread_mutex_unlock(&spill.lock);
+
+		for (off = 0; off < w->len; off += r) {
+			r = pwrite(w->fd, w->data + off, w->len - off,
+			           w->off + off);
+			if (r < 0 && errno == EINTR) {
+				r = 0;
+			} else if (r < 0) {
+				w->err = errno;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&spill.lock);
+		spill.done++;
+		pthread_cond_signal(&spill.wrote);
+	}
+	return NULL;
+}
+
+/* decode cold block i, the last one decoded is kept */
+HistCells *
+histthaw(size_t i)
+{
+	static uchar *raw;
+	static size_t rawsiz;
+	HistBlock *b = BLK(i), *prev;
+	const uchar *data;
+	uintptr_t pg;
+
+	if (hist.cache == b)
+		return &hist.dec;
+	if ((data = b->data) == NULL && (data = segread(b)) == NULL)
+		return NULL;
+	scratch(&raw, &rawsiz, b->rawlen);
+	lzunpack(data, b->len, raw);
+	histunpack(raw, raw + b->rawlen, &hist.dec);
+	hist.cache = b;
+	hist.thawed++;
+
+	/* reading back goes on to older lines, let them page in meanwhile */
+	if (i > 0 && (prev = BLK(i-1))->seg && prev->seg->map) {
+		pg = (uintptr_t)(prev->seg->map + prev->segoff) &
+		     ~(uintptr_t)(getpagesize() - 1);
+		madvise((void *)pg, prev->seg->map + prev->segoff +
+		        prev->len - (uchar *)pg, MADV_WILLNEED);
+	}
+	return &hist.dec;
+}
+
+/*
+ * Segment files are unlinked as soon as they are created, the space
+ * goes back when they are closed however the session ends.
+ */
+Segment *
+segnew(void)
+{
+	Segment *s;
+	const char *dir;
+	char path[PATH_MAX];
+	int fd;
+
+	if ((dir = histdir) == NULL && (dir = getenv("TMPDIR")) == NULL)
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/fterm-hist.XXXXXX", dir);
+	if ((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "histspill: %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	s = xmalloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	hist.seg = xrealloc(hist.seg, (hist.nseg + 1) * sizeof(*hist.seg));
+	hist.seg[hist.nseg++] = s;
+	return s;
+}
+
+/*
+ * The whole segment is mapped at once, appends made after are seen
+ * through the shared mapping. Pages are read in when first touched.
+ */
+const uchar *
+segread(const HistBlock *b)
+{
+	static uchar *buf;
+	static size_t bufsiz;
+	Segment *s = b->seg;
+	size_t off;
+	ssize_t r;
+	void *p;
+
+	if (s->map == NULL) {
+		p = mmap(NULL, SEG_MAX, PROT_READ, MAP_SHARED, s->fd, 0);
+		if (p != MAP_FAILED)
+			s->map = p;
+	}
+	if (s->map)
+		return s->map + b->segoff;
+
+	scratch(&buf, &bufsiz, b->len);
+	for (off = 0; off < b->len; off += r) {
+		r = pread(s->fd, buf + off, b->len - off, b->segoff + off);
+		if (r < 0 && errno == EINTR)
+			r = 0;
+		else if (r <= 0)
+			return NULL;
+	}
+	return buf;
+}
+
+void
+segfree(Segment *s)
+{
+	if (s->map)
+		munmap(s->map, SEG_MAX);
+	close(s->fd);
+	hist.disk -= s->len;
+	free(s);
+}
+
+/*
+ * A packed line is its length and fill glyph followed by runs of cells
+ * sharing mode and colors, each run being its length, the attributes
+ * and the runes. All numbers are stored as varints.
+ */
+size_t
+histpack(const HistBlock *b, uchar *dst)
+{
+	const HistCells *c = b->hot;
+	const Glyph *gp, *end, *run;
+	uchar *p = dst;
+	int i;
+
+	for (i = 0; i < b->n; i++) {
+		gp = &c->cells[c->off[i]];
+		end = &c->cells[c->off[i+1] - 1];
+		p = putvar(p, end - gp);
+		p = putvar(p, end->u);
+		p = putvar(p, end->mode);
+		p = putvar(p, styles[end->style].fg);
+		p = putvar(p, styles[end->style].bg);
+		while (gp < end) {
+			for (run = gp + 1; run < end && !ATTRCMP(*run, *gp); run++)
+				;
+			p = putvar(p, run - gp);
+			p = putvar(p, gp->mode);
+			p = putvar(p, styles[gp->style].fg);
+			p = putvar(p, styles[gp->style].bg);
+			for (; gp < run; gp++) {
+				if (gp->u < 0x80)
+					*p++ = gp->u;
+				else
+					p = putvar(p, gp->u);
+			}
+		}
+	}
+	return p - dst;
+}
+
+void
+histunpack(const uchar *p, const uchar *end, HistCells *c)
+{
+	uint32_t len, run, mode, fg, bg, v;
+	ushort style;
+	Glyph *gp;
+	int n;
+
+	for (n = 0; p < end; n++) {
+		p = getvar(p, &len);
+		cellsreserve(c, c->off[n] + len + 1);
+		gp = &c->cells[c->off[n]];
+		p = getvar(p, &v);
+		gp[len].u = v;
+		p = getvar(p, &v);
+		gp[len].mode = v;
+		p = getvar(p, &fg);
+		p = getvar(p, &bg);
+		gp[len].style = styleid(fg, bg);
+		c->off[n + 1] = c->off[n] + len + 1;
+
+		while (gp < &c->cells[c->off[n + 1] - 1]) {
+			p = getvar(p, &run);
+			p = getvar(p, &mode);
+			p = getvar(p, &fg);
+			p = getvar(p, &bg);
+			style = styleid(fg, bg);
+			for (; run > 0; run--, gp++) {
+				p = getvar(p, &v);
+				gp->u = v;
+				gp->mode = mode;
+				gp->style = style;
+			}
+		}
+	}
+}
+
+/*
+ * Add the trigrams of line l of c to sig, feeding at most max runes.
+ * w holds the last two runes fed and nw their count, trigrams go on
+ * over the end of a line only if it wraps. Returns whether it does.
+ */
+int
+sigline(uint64_t *sig, const HistCells *c, int l, Rune *w, int *nw,
+        int *max)
+{
+	const Glyph *gp = &c->cells[c->off[l]];
+	const Glyph *end = &c->cells[c->off[l+1] - 1];
+	uint h;
+	int wrap;
+
+	wrap = end > gp && (end[-1].mode & ATTR_WRAP);
+	for (; gp < end && *max > 0; gp++) {
+		if (gp->mode & ATTR_WDUMMY)
+			continue;
+		if (*nw >= 2) {
+			h = TRIHASH(w[0], w[1], gp->u) >> (32 - SIG_SHIFT);
+			sig[h >> 6] |= (uint64_t)1 << (h & 63);
+		}
+		w[0] = w[1];
+		w[1] = gp->u;
+		(*nw)++;
+		(*max)--;
+	}
+	if (!wrap)
+		*nw = 0;
+	return wrap;
+}
+
+void
+cellsreserve(HistCells *c, size_t n)
+{
+	size_t siz;
+
+	if (n <= c->cellsiz)
+		return;
+	for (siz = MAX(c->cellsiz, 1); siz < n; siz *= 2)
+		;
+	c->cells = xrealloc(c->cells, siz * sizeof(Glyph));
+	/* stylegc() looks at every cell, see histmark() */
+	memset(&c->cells[c->cellsiz], 0, (siz - c->cellsiz) * sizeof(Glyph));
+	if (c != &hist.dec)
+		hist.hot += (siz - c->cellsiz) * sizeof(Glyph);
+	c->cellsiz = siz;
+}
+
+uchar *
+scratch(uchar **buf, size_t *siz, size_t n)
+{
+	if (n > *siz) {
+		*buf = xrealloc(*buf, n);
+		*siz = n;
+	}
+	return *buf;
+}
+
+uchar *
+putvar(uchar *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+	return p;
+}
+
+const uchar *
+getvar(const uchar *p, uint32_t *v)
+{
+	int s;
+
+	for (*v = 0, s = 0; *p & 0x80; s += 7)
+		*v |= (uint32_t)(*p++ & 0x7f) << s;
+	*v |= (uint32_t)*p++ << s;
+	return p;
+}
+
+static uint32_t
+lzread32(const uchar *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uchar *
+lzputlen(uchar *p, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*p++ = 255;
+	*p++ = n;
+	return p;
+}
+
+/*
+ * LZ4 style block compression. Every sequence is a token holding the
+ * literal and match lengths, the literals, then a 16 bit offset back
+ * to the match. Lengths that do not fit in the token continue in
+ * bytes of 255. The block always ends with a literal only sequence.
+ * The hash table is not cleared between calls, entries left by an
+ * earlier input are only a wasted compare.
+ */
+size_t
+lzpack(const uchar *src, size_t n, uchar *dst)
+{
+	static size_t tab[1 << LZ_HASHBITS];
+	size_t ip, anchor, mlen, lit, ref, miss;
+	uint32_t v, h;
+	uchar *op = dst;
+
+	for (ip = anchor = miss = 0; ip + LZ_MINMATCH <= n; ) {
+		v = lzread32(src + ip);
+		h = (v * 2654435761u) >> (32 - LZ_HASHBITS);
+		ref = tab[h];
+		tab[h] = ip;
+		if (ref >= ip || ip - ref > 0xffff ||
+		    lzread32(src + ref) != v) {
+			/* step faster through data that does not compress */
+			ip += 1 + (miss++ >> 5);
+			continue;
+		}
+		miss = 0;
+		for (mlen = LZ_MINMATCH; ip + mlen < n &&
+		     src[ref + mlen] == src[ip + mlen]; mlen++)
+			;
+
+		lit = ip - anchor;
+		*op++ = MIN(lit, 15) << 4 | MIN(mlen - LZ_MINMATCH, 15);
+		if (lit >= 15)
+			op = lzputlen(op, lit - 15);
+		memcpy(op, src + anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (mlen - LZ_MINMATCH >= 15)
+			op = lzputlen(op, mlen - LZ_MINMATCH - 15);
+		ip += mlen;
+		anchor = ip;
+	}
+
+	lit = n - anchor;
+	*op++ = MIN(lit, 15) << 4;
+	if (lit >= 15)
+		op = lzputlen(op, lit - 15);
+	memcpy(op, src + anchor, lit);
+	return op + lit - dst;
+}
+
+size_t
+lzunpack(const uchar *src, size_t n, uchar *dst)
+{
+	const uchar *ip = src, *end = src + n;
+	uchar *op = dst;
+	size_t lit, mlen, off;
+	uchar t;
+
+	while (ip < end) {
+		t = *ip++;
+		if ((lit = t >> 4) == 15) {
+			do
+				lit += *ip;
+			while (*ip++ == 255);
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip >= end)
+			break;
+
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if ((mlen = t & 15) == 15) {
+			do
+				mlen += *ip;
+			while (*ip++ == 255);
+		}
+		/* the match may overlap what it produces */
+		for (mlen += LZ_MINMATCH; mlen > 0; mlen--, op++)
+			*op = *(op - off);
+	}
+	return op - dst;
+}
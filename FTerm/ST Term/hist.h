@@ -0,0 +1,42 @@
+//
+//  hist.h
+//  FTerm
+//
+//  Scrollback history, see hist.c
+//
+
+#ifndef hist_h
+#define hist_h
+
+#include <stddef.h>
+#include "st.h"
+
+typedef struct {
+	size_t lines;   /* lines kept */
+	size_t blocks;  /* blocks in the index */
+	size_t hot;     /* bytes of uncompressed recent lines */
+	size_t cold;    /* bytes of compressed older lines */
+	size_t disk;    /* bytes of older lines spilled to segment files */
+	size_t index;   /* bytes of block headers, trigrams and index */
+	size_t raw;     /* what the kept lines would take as Glyphs */
+	size_t dropped; /* lines dropped to stay within budget */
+	size_t thawed;  /* cold blocks decoded so far */
+} HistStat;
+
+#define HIST_SEARCHMAX	256	/* runes of a pattern used to skip blocks */
+
+typedef struct {
+	int n;
+	uint bit[HIST_SEARCHMAX];
+} HistQuery;
+
+void histpush(const Glyph *, int);
+int histlines(void);
+int histline(int, Glyph *, int);
+void histclear(void);
+void histstat(HistStat *);
+void histmark(uchar *);
+void histquery(HistQuery *, const Rune *, int);
+int histskip(int, int, const HistQuery *);
+
+#endif /* hist_h */
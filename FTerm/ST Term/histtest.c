@@ -0,0 +1,124 @@
+//
+//  histtest.c
+//  FTerm
+//
+//  Checks the search of the history. Log lines of about 100 columns,
+//  more trigrams than a fixed bitmap per block tells apart, scroll into
+//  the history through twrite(). A pattern none of them has, though
+//  close to what they have, must leave nearly every cold block
+//  undecoded, one written long ago must be found where it was written
+//  and be what is selected once shown. Not part of the Xcode target, build it
+//  with the Makefile next to it.
+//
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "hist.h"
+#include "search.h"
+#include "config.def.h"
+
+#define COLS		120
+#define LINES		20000
+#define OLD		1000	/* the line searched for */
+#define DECODED		100	/* most cold blocks in 10000 decoded in vain */
+
+static int logline(char *, size_t, int);
+static int search(const char *, Match *, size_t *);
+
+extern Term term;
+
+/* line n of the log, the same every run */
+int
+logline(char *buf, size_t siz, int n)
+{
+	uint32_t r = n * 2654435761u + 12345;
+
+	r ^= r >> 15;
+	r *= 0x2c1b3c6d;
+	r ^= r >> 12;
+	return snprintf(buf, siz, "%05d 12:%02d:%02d.%03u worker-%u GET "
+	                "/api/v1/items/%u?session=%08x&trace=%08x "
+	                "status=200 bytes=%u", n, n / 60 % 60, n % 60,
+	                r % 1000, r % 7, r % 100000, r * 31, r ^ 0x5bd1e995,
+	                r % 65536);
+}
+
+/* the newest match of pat and the cold blocks decoded finding it */
+int
+search(const char *pat, Match *m, size_t *decoded)
+{
+	Rune p[64];
+	HistStat st;
+	size_t before;
+	int n, found;
+
+	for (n = 0; pat[n]; n++)
+		p[n] = (uchar)pat[n];
+	histstat(&st);
+	before = st.thawed;
+	found = tsearch(p, n, term.col, term.row - 1, -1, m);
+	histstat(&st);
+	*decoded = st.thawed - before;
+	return found;
+}
+
+int
+main(void)
+{
+	char buf[256], *t, *s;
+	HistStat st;
+	Match m;
+	size_t decoded, cold;
+	int i, n;
+
+	setlocale(LC_CTYPE, "");
+	tnew(COLS, rows);
+	selinit();
+	for (i = 0; i < LINES; i++) {
+		n = logline(buf, sizeof(buf) - 2, i);
+		twrite(buf, n, 0);
+		twrite("\r\n", 2, 0);
+	}
+	histstat(&st);
+	cold = st.blocks - 4;
+
+	if (search("GET /api/v2", &m, &decoded)) {
+		fprintf(stderr, "histtest: found a pattern never written\n");
+		return 1;
+	}
+	printf("histtest: %zu of %zu cold blocks decoded for a missing "
+	       "pattern\n", decoded, cold);
+	if (decoded * 10000 > cold * DECODED) {
+		fprintf(stderr, "histtest: the trigrams skipped too few\n");
+		return 1;
+	}
+
+	/* line OLD is history line LINES - rows - OLD, row -1 the newest */
+	logline(buf, sizeof(buf), OLD);
+	t = strstr(buf, "trace=");
+	t[14] = '\0';
+	if (!search(t, &m, &decoded) ||
+	    m.y0 != OLD - LINES + (int)term.row - 1 || m.x0 != t - buf) {
+		fprintf(stderr, "histtest: %s not found where written\n", t);
+		return 1;
+	}
+
+	/* scrolled to the middle of the view, the selection is the match */
+	searchshow(&m);
+	s = getsel();
+	if (s == NULL || strcmp(s, t) != 0 ||
+	    term.scr != (int)term.row / 2 - m.y0) {
+		fprintf(stderr, "histtest: %s is not what is selected\n", t);
+		return 1;
+	}
+	free(s);
+	printf("histtest: ok, %zu decoded finding a line %d back\n",
+	       decoded, LINES - OLD);
+	return 0;
+}
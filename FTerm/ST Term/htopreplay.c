@@ -0,0 +1,112 @@
+//
+//  htopreplay.c
+//  FTerm
+//
+//  Replays a session of htop on a 120x50 screen and counts the cells
+//  handed to the renderer. Like htop, every frame repaints the whole
+//  screen: a few CPU meters and a process table, each row placed with
+//  its own cursor move and cleared to its end. From one frame to the
+//  next only the meters and some CPU columns change, so a frame is
+//  the 6000 cells written and the far fewer the damage says changed.
+//  The session is made up the same on every run. Not part of make
+//  check, run it with make bench.
+//
+
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "config.def.h"
+
+#define COLS		120
+#define ROWS		50
+#define METERS		3	/* rows of CPU meters above the processes */
+#define FRAMES		300
+
+static uint32_t rnd(void);
+static size_t frame(char *, size_t);
+static size_t damaged(void);
+
+static uint32_t seed = 3;
+
+/* xorshift, the same numbers each run */
+uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* the bytes htop writes for one frame */
+size_t
+frame(char *buf, size_t siz)
+{
+	size_t n = 0;
+	double cpu;
+	int y, bar;
+
+	n += snprintf(buf + n, siz - n, "\033[H");
+	for (y = 0; y < ROWS; y++) {
+		n += snprintf(buf + n, siz - n, "\033[%d;1H", y + 1);
+		if (y < METERS) {
+			bar = 10 + rnd() % 51;
+			n += snprintf(buf + n, siz - n,
+			              "\033[1;32m  CPU[\033[0m%.*s\033[K", bar,
+			              "||||||||||||||||||||||||||||||||||||||||"
+			              "||||||||||||||||||||");
+			continue;
+		}
+		/* most processes idle along at the same CPU */
+		if (rnd() % 100 < 15)
+			cpu = rnd() % 1000 / 10.0;
+		else
+			cpu = y * 7 % 100;
+		n += snprintf(buf + n, siz - n, "\033[%dm%6d root      20   0  "
+		              "%5.1f  0.3  /usr/bin/process-%d --flag\033[0m"
+		              "\033[K", 30 + y % 8, 1000 + y, cpu, y);
+	}
+	return n;
+}
+
+/* the cells draw() found changed, taken as a renderer takes them */
+size_t
+damaged(void)
+{
+	size_t cells = 0;
+	int y, x0, x1;
+
+	draw();
+	tdamagebegin();
+	while (tdamagenext(&y, &x0, &x1))
+		cells += x1 - x0 + 1;
+	tdamageend();
+	return cells;
+}
+
+int
+main(void)
+{
+	char buf[16384];
+	size_t cells = 0;
+	int i;
+
+	setlocale(LC_CTYPE, "");
+	tnew(COLS, ROWS);
+	selinit();
+	twrite("\033[?1049h", 8, 0);
+	damaged();
+
+	for (i = 0; i < FRAMES; i++) {
+		twrite(buf, frame(buf, sizeof(buf)), 0);
+		cells += damaged();
+	}
+	printf("htopreplay: %d frames of %d cells, %.0f cells damaged "
+	       "per frame\n", FRAMES, COLS * ROWS, (double)cells / FRAMES);
+	return 0;
+}
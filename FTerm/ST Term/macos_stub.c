@@ -0,0 +1,56 @@
+//
+//  macos_stub.c
+//  FTerm
+//
+//  What macos_support.c gives the terminal core, for the programs the
+//  Makefile builds without the app. Nothing is drawn, the cursor and
+//  the rows scrolled are kept for snap.c as the app keeps them.
+//
+
+#include <wchar.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "macos_support.h"
+
+MacOS_Cursor macos_cursor;
+int macos_palette_dirty;
+int macos_scrolled;
+
+void macos_bell(void) {}
+void macos_clipcopy(void) {}
+void macos_drawline(Line line, int x1, int y1, int x2) {}
+void macos_finishdraw(void) {}
+void macos_loadcols(void) {}
+int macos_setcolorname(int x, const char *name) { return 1; }
+void macos_seticontitle(char *p) {}
+void macos_settitle(char *p) {}
+int macos_setcursor(int cursor) { return 0; }
+void macos_setmode(int set, unsigned int flags) {}
+void macos_setpointermotion(int set) {}
+void macos_setsel(char *str) {}
+int macos_startdraw(void) { return 1; }
+void macos_ximspot(int x, int y) {}
+void macos_cresize(int width, int height) {}
+
+int
+macos_scroll(int n)
+{
+	macos_scrolled += n;
+	return 1;
+}
+
+void
+macos_drawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
+{
+	macos_cursor.cx = cx;
+	macos_cursor.cy = cy;
+	macos_cursor.g = g;
+}
+
+int
+macos_getcolor(int x, unsigned char *r, unsigned char *g, unsigned char *b)
+{
+	*r = *g = *b = 0;
+	return 0;
+}
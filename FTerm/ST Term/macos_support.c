@@ -38,6 +38,7 @@ ColorEntry *default_x11_color_table;
 #define MAX_COLOR_TABLE_ENTRY 1024
 int init_color_palette = 1;
 int macos_palette_dirty = 0;                // read in Renederer updatePalette
+int macos_scrolled = 0;                     // rows scrolled up, read in snap.c
 int palette_size = MAX_COLOR_TABLE_ENTRY;
 ColorEntry color_palette[MAX_COLOR_TABLE_ENTRY];
 
@@ -364,6 +365,7 @@ void macos_clipcopy(void)
 void macos_drawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 {
 //    X11_Color drawcol;
+    uint32_t fg, bg;
 
     if (IS_SET(MODE_HIDE))
         return;
@@ -375,25 +377,26 @@ void macos_drawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 
     if (IS_SET(MODE_REVERSE)) {
         g.mode |= ATTR_REVERSE;
-        g.bg = defaultfg;
+        bg = defaultfg;
         if (selected(cx, cy)) {
 //            drawcol = dc.col[defaultcs];
-            g.fg = defaultrcs;
+            fg = defaultrcs;
         } else {
 //            drawcol = dc.col[defaultrcs];
-            g.fg = defaultcs;
+            fg = defaultcs;
         }
     } else {
         if (selected(cx, cy)) {
-            g.fg = defaultfg;
-            g.bg = defaultrcs;
+            fg = defaultfg;
+            bg = defaultrcs;
         } else {
-            g.fg = defaultbg;
-            g.bg = defaultcs;
+            fg = defaultbg;
+            bg = defaultcs;
         }
-//        drawcol = dc.col[g.bg];
+//        drawcol = dc.col[bg];
     }
-    
+    g.style = styleid(fg, bg);
+
     macos_cursor.cx = cx;
     macos_cursor.cy = cy;
     macos_cursor.g = g;
@@ -405,6 +408,15 @@ void macos_drawline(Line line, int x1, int y1, int x2)
     //printf("%s line %p x1:%d y1:%d x2:%d\n", __FUNCTION__, line, x1, y1, x2);
 }
 
+// The renderer keeps its cells and quads from frame to frame. The rows
+// scrolled go to it in the snapshot and it moves what it has instead of
+// building every row again, see snapread().
+int macos_scroll(int n)
+{
+    macos_scrolled += n;
+    return 1;
+}
+
 void macos_finishdraw(void)
 {
     //printf("%s\n", __FUNCTION__);
@@ -43,6 +43,7 @@ void macos_bell(void);
 void macos_clipcopy(void);
 void macos_drawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og);
 void macos_drawline(Line line, int x1, int y1, int x2);
+int macos_scroll(int n);
 void macos_finishdraw(void);
 void macos_loadcols(void);
 int macos_setcolorname(int x, const char *name);
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+#
+#  mkwidth.py
+#  FTerm
+#
+#  Generates runewidth.h, the column width table used by tputc() instead
+#  of the locale dependent wcwidth(). Widths come from the Unicode data
+#  bundled with Python, so rerun this with a newer Python to pick up a
+#  newer Unicode version:
+#
+#      python3 mkwidth.py > runewidth.h
+#
+
+import sys
+import unicodedata
+
+MAXRUNE = 0x10FFFF
+BLKSIZ = 256            # runes per second level block
+PERBYTE = 4             # 2 bit widths packed per byte
+
+# prepended concatenation marks, Cf but drawn with the following digits
+PREPENDED = set(range(0x0600, 0x0606)) | {0x06DD, 0x070F, 0x0890, 0x0891,
+                                          0x08E2, 0x110BD, 0x110CD}
+
+
+def width(u):
+    c = chr(u)
+    cat = unicodedata.category(c)
+
+    if u == 0x00AD or u in PREPENDED:   # visible format chars
+        return 1
+    if cat in ('Mn', 'Me', 'Cf'):       # combining and format chars
+        return 0
+    if 0x1160 <= u <= 0x11FF or 0xD7B0 <= u <= 0xD7FF:
+        return 0                        # hangul medial vowels, finals
+    if 0x20000 <= u <= 0x2FFFD or 0x30000 <= u <= 0x3FFFD:
+        return 2                        # CJK planes, assigned or not
+    if cat in ('Cn', 'Co', 'Cs'):       # eaw is not reliable for these
+        return 1
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2                        # includes emoji presentation
+    return 1
+
+
+def main():
+    blocks = []
+    index = {}
+    first = []
+
+    for base in range(0, MAXRUNE + 1, BLKSIZ):
+        packed = []
+        for i in range(0, BLKSIZ, PERBYTE):
+            b = 0
+            for j in range(PERBYTE):
+                b |= width(base + i + j) << (2 * j)
+            packed.append(b)
+        packed = tuple(packed)
+        if packed not in index:
+            index[packed] = len(blocks)
+            blocks.append(packed)
+        first.append(index[packed])
+
+    out = sys.stdout
+    out.write('/* generated by mkwidth.py from Unicode %s, do not edit */\n\n'
+              % unicodedata.unidata_version)
+    out.write('#ifndef runewidth_h\n#define runewidth_h\n\n')
+
+    out.write('/* second level block for every %d runes */\n' % BLKSIZ)
+    out.write('static const uchar runewidth_blk[%d] = {\n' % len(first))
+    for i in range(0, len(first), 16):
+        out.write('\t' + ', '.join('%3d' % b for b in first[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('/* widths 0, 1 or 2, %d per byte starting at the low bits */\n'
+              % PERBYTE)
+    out.write('static const uchar runewidth_tbl[%d][%d] = {\n'
+              % (len(blocks), BLKSIZ // PERBYTE))
+    for blk in blocks:
+        out.write('\t{\n')
+        for i in range(0, len(blk), 8):
+            out.write('\t\t' + ', '.join('0x%02x' % b for b in blk[i:i + 8])
+                      + ',\n')
+        out.write('\t},\n')
+    out.write('};\n\n')
+
+    out.write('''static inline int
+runewidth(Rune u)
+{
+	const uchar *blk;
+
+	if (u > 0x%X)
+		return 1;
+	blk = runewidth_tbl[runewidth_blk[u >> 8]];
+	return (blk[(u & 0xff) >> 2] >> ((u & 3) << 1)) & 3;
+}
+
+#endif /* runewidth_h */
+''' % MAXRUNE)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+//
+//  pace.c
+//  FTerm
+//
+//  Decides on each display tick whether the changes to the screen are
+//  drawn now or held for more. A small change, like the echo of a key,
+//  is drawn on the next tick. Anything bigger is held while output keeps
+//  coming, as st does, until it pauses for a while that shrinks from
+//  minlatency to nothing as maxlatency since the first change nears, so
+//  a flood costs a frame per maxlatency rather than one per tick and a
+//  command that prints a screenful is drawn once, complete.
+//
+//  The functions only work on the Pace passed and take the time as an
+//  argument, the caller locks and reads the clock. Times are in ms.
+//
+
+#include <string.h>
+
+#include "pace.h"
+
+#define PACE_ECHO	512	/* input bytes still drawn at once */
+
+static void pacedrawn(Pace *, double);
+
+void
+paceinit(Pace *p, double minlat, double maxlat)
+{
+	memset(p, 0, sizeof(*p));
+	p->minlat = minlat;
+	p->maxlat = maxlat;
+}
+
+/* the screen changed at now, after parsing n bytes of input */
+void
+pacechange(Pace *p, double now, size_t n)
+{
+	if (!p->pending) {
+		p->pending = 1;
+		p->first = now;
+		p->bytes = 0;
+	}
+	p->last = now;
+	p->bytes += n;
+}
+
+/*
+ * Whether a frame is drawn at the display tick at now. When it returns
+ * 1 the changes so far count as drawn.
+ */
+int
+pacedue(Pace *p, double now)
+{
+	double waited, timeout;
+
+	if (!p->pending)
+		return 0;
+
+	if (p->bytes <= PACE_ECHO) {
+		p->st.echo++;
+	} else if ((waited = now - p->first) >= p->maxlat) {
+		p->st.forced++;
+	} else {
+		/* idle for less and less the longer it has been waiting */
+		timeout = (p->maxlat - waited) / p->maxlat * p->minlat;
+		if (now - p->last < timeout) {
+			p->st.skipped++;
+			return 0;
+		}
+		p->st.idle++;
+	}
+	pacedrawn(p, now);
+	return 1;
+}
+
+void
+pacedrawn(Pace *p, double now)
+{
+	double lat = now - p->first;
+	int b;
+
+	for (b = 0; lat >= 2 && b < PACE_HISTBINS - 1; lat /= 2)
+		b++;
+	p->st.latency[b]++;
+	p->st.lastlat = now - p->first;
+	p->st.frames++;
+	p->pending = 0;
+}
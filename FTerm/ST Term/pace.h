@@ -0,0 +1,37 @@
+//
+//  pace.h
+//  FTerm
+//
+//  When to draw the changes to the screen, see pace.c
+//
+
+#ifndef pace_h
+#define pace_h
+
+#include <stddef.h>
+
+#define PACE_HISTBINS	8	/* log2 ms bins, the last from 128ms up */
+
+typedef struct {
+	size_t frames;                  /* frames drawn */
+	size_t skipped;                 /* ticks held back with changes waiting */
+	size_t echo;                    /* drawn at once, the changes were small */
+	size_t idle;                    /* drawn once output paused */
+	size_t forced;                  /* drawn at maxlatency under a flood */
+	double lastlat;                 /* ms from first change to the last frame */
+	size_t latency[PACE_HISTBINS];  /* frames by log2 of that latency */
+} PaceStat;
+
+typedef struct {
+	double minlat, maxlat;  /* ms, see minlatency and maxlatency */
+	int pending;            /* changes not drawn yet */
+	double first, last;     /* when the first and last of them came */
+	size_t bytes;           /* input parsed for them */
+	PaceStat st;
+} Pace;
+
+void paceinit(Pace *, double, double);
+void pacechange(Pace *, double, size_t);
+int pacedue(Pace *, double);
+
+#endif /* pace_h */
@@ -0,0 +1,183 @@
+//
+//  pacetest.c
+//  FTerm
+//
+//  Checks when pace.c draws, on a clock that is only the times passed
+//  in: the echo of a key drawn on the next tick, a bigger change held
+//  while output keeps coming and drawn once it pauses, a flood drawn
+//  at maxlatency, and the counters and the latency histogram kept for
+//  all of it. Not part of the Xcode target, build it with the Makefile
+//  next to it.
+//
+
+#include <stdio.h>
+#include <wchar.h>
+
+#include "st.h"
+#include "pace.h"
+#include "config.def.h"
+
+#define TICK		(1000.0 / 60)	/* ms between display ticks */
+#define BIG		4096		/* bytes of output not drawn at once */
+#define FLOODTICKS	60
+
+static int counted(Pace *, const char *);
+static int echo(void);
+static int hold(void);
+static int flood(void);
+static int histogram(void);
+
+/* every frame counted once, by why it was drawn and by its latency */
+int
+counted(Pace *p, const char *what)
+{
+	size_t n = 0;
+	int b;
+
+	for (b = 0; b < PACE_HISTBINS; b++)
+		n += p->st.latency[b];
+	if (p->st.frames != p->st.echo + p->st.idle + p->st.forced ||
+	    p->st.frames != n) {
+		fprintf(stderr, "pacetest: %s: %zu frames, %zu echo, %zu idle, "
+		        "%zu forced, %zu in the histogram\n", what,
+		        p->st.frames, p->st.echo, p->st.idle, p->st.forced, n);
+		return 0;
+	}
+	return 1;
+}
+
+int
+echo(void)
+{
+	Pace p;
+
+	paceinit(&p, minlatency, maxlatency);
+	if (pacedue(&p, TICK)) {
+		fprintf(stderr, "pacetest: drawn with nothing changed\n");
+		return 0;
+	}
+	/* a key at 20ms, its echo 1ms later */
+	pacechange(&p, 21, 1);
+	if (!pacedue(&p, 2 * TICK) || p.st.echo != 1 ||
+	    p.st.lastlat != 2 * TICK - 21) {
+		fprintf(stderr, "pacetest: the echo is not drawn on the next "
+		        "tick\n");
+		return 0;
+	}
+	if (pacedue(&p, 3 * TICK)) {
+		fprintf(stderr, "pacetest: the echo is drawn twice\n");
+		return 0;
+	}
+	return counted(&p, "echo");
+}
+
+int
+hold(void)
+{
+	Pace p;
+	double t;
+
+	/* output every ms up to 8ms, a tick at 120Hz falls in it */
+	paceinit(&p, minlatency, maxlatency);
+	for (t = 0; t <= 8; t++)
+		pacechange(&p, t, BIG);
+	if (pacedue(&p, TICK / 2)) {
+		fprintf(stderr, "pacetest: drawn while output keeps coming\n");
+		return 0;
+	}
+	/* then it pauses for longer than it is waited for by now */
+	if (!pacedue(&p, TICK) || p.st.idle != 1 || p.st.skipped != 1) {
+		fprintf(stderr, "pacetest: not drawn once output paused\n");
+		return 0;
+	}
+
+	/* a 2ms pause holds the frame early on, not near maxlatency */
+	pacechange(&p, 100, BIG);
+	pacechange(&p, 106, BIG);
+	if (pacedue(&p, 108)) {
+		fprintf(stderr, "pacetest: drawn after a short pause early\n");
+		return 0;
+	}
+	pacechange(&p, 100 + maxlatency - 5, BIG);
+	if (!pacedue(&p, 100 + maxlatency - 3) || p.st.idle != 2) {
+		fprintf(stderr, "pacetest: held for a short pause near "
+		        "maxlatency\n");
+		return 0;
+	}
+	return counted(&p, "hold");
+}
+
+int
+flood(void)
+{
+	Pace p;
+	double t;
+	int k;
+
+	/* output right up to every tick, it never pauses */
+	paceinit(&p, minlatency, maxlatency);
+	for (k = 0; k < FLOODTICKS; k++) {
+		t = k * TICK;
+		pacechange(&p, t, BIG);
+		if (!pacedue(&p, t))
+			continue;
+		if (p.st.lastlat < maxlatency ||
+		    p.st.lastlat >= maxlatency + TICK) {
+			fprintf(stderr, "pacetest: flood drawn after %.1fms\n",
+			        p.st.lastlat);
+			return 0;
+		}
+	}
+	if (p.st.frames == 0 || p.st.forced != p.st.frames ||
+	    p.st.frames > FLOODTICKS / 2) {
+		fprintf(stderr, "pacetest: %zu frames, %zu forced, for %d "
+		        "ticks of flood\n", p.st.frames, p.st.forced,
+		        FLOODTICKS);
+		return 0;
+	}
+	if (!counted(&p, "flood"))
+		return 0;
+	printf("pacetest: %zu frames for %d ticks of flood\n",
+	       p.st.frames, FLOODTICKS);
+	return 1;
+}
+
+int
+histogram(void)
+{
+	/* latencies and the log2 bins they go in, the last has the rest */
+	static const double lat[] = { 0, 1, 3, 16.5, 40, 500 };
+	static const size_t want[PACE_HISTBINS] = { 2, 1, 0, 0, 1, 1, 0, 1 };
+	Pace p;
+	double t = 0;
+	int i;
+
+	paceinit(&p, minlatency, maxlatency);
+	for (i = 0; i < LEN(lat); i++) {
+		pacechange(&p, t, 1);
+		pacedue(&p, t + lat[i]);
+		t += 1000;
+	}
+	for (i = 0; i < PACE_HISTBINS; i++) {
+		if (p.st.latency[i] != want[i]) {
+			fprintf(stderr, "pacetest: %zu frames in latency bin "
+			        "%d, not %zu\n", p.st.latency[i], i, want[i]);
+			return 0;
+		}
+	}
+	if (p.st.lastlat != 500) {
+		fprintf(stderr, "pacetest: last latency %.1fms\n",
+		        p.st.lastlat);
+		return 0;
+	}
+	return counted(&p, "histogram");
+}
+
+int
+main(void)
+{
+	if (!echo() || !hold() || !flood() || !histogram())
+		return 1;
+	printf("pacetest: ok\n");
+	return 0;
+}
@@ -0,0 +1,792 @@
+//
+//  pipeline.c
+//  FTerm
+//
+//  The pty is drained by a reader thread into a ring, which grows from
+//  RING_MIN up to RING_MAX while the parser falls behind. The reader
+//  reads until the pty is empty or readbudget is used up before it
+//  wakes the parser, so a fast producer costs a wakeup per batch rather
+//  than per read and never waits for the kernel buffer. A parser thread
+//  feeds the ring to twrite() as fast as it fills and the renderer only
+//  takes the terminal lock to copy what changed once per frame. Reading
+//  no longer waits for frames, and a frame waits for at most one slice
+//  of parsing. Anything else that reads or changes the terminal outside
+//  of the parser has to hold pipelock(). Each time the lock is given up
+//  what changed is published as a snapshot, see snap.c, so readers of
+//  the screen do not need the lock at all.
+//
+//  Nothing blocks on writing to the pty either. ttywrite() appends to
+//  one of two lanes, replies and keys to LANE_KEY, pastes to LANE_BULK,
+//  and the reader thread writes them out whenever the pty takes more.
+//  Key bytes always go first and bulk data is written in WQ_CHUNK
+//  pieces, so neither a reply nor a key waits behind a paste.
+//
+//  A paste is not queued at once either. pipepaste() keeps it and the
+//  reader converts and queues PASTE_CHUNK bytes of it each time the
+//  bulk lane runs low, so any size streams through at the pace of the
+//  pty and pipepastecancel() can drop the rest.
+//
+//  The reader thread sleeps in the event loop of evloop.c, on the pty
+//  and on evwake() from the threads that queue bytes or pastes. It runs
+//  the blink timer too, which the parser starts whenever blinking text
+//  is set and which stops once no blinking text is left, so an idle
+//  terminal has every thread asleep.
+//
+//  Every publish that shows something new is told to the pacing of
+//  pace.c, with the input parsed for it, and the renderer asks
+//  pipeframe() on each display tick whether to draw. While an
+//  application draws inside a synchronized update, mode 2026, parsing
+//  goes on but nothing is published until it ends or synctimeout runs
+//  out, so only the finished screen is drawn.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+ #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+ #include <arm_neon.h>
+#endif
+
+#include "st.h"
+#include "st_types.h"
+#include "ring.h"
+#include "evloop.h"
+#include "pipeline.h"
+#include "snap.h"
+#include "pace.h"
+
+#define RING_MIN	(1 << 16)	/* bytes read ahead of the parser */
+#define RING_MAX	(1 << 20)	/* most read ahead when it falls behind */
+#define PARSE_SLICE	(1 << 12)	/* bytes parsed between lock checks */
+#define PARSE_MAX	(1 << 16)	/* bytes parsed per hold of the lock */
+#define PUBLISH_RETRY	1000000	/* ns until a pending snapshot is retried */
+#define WQ_CHUNK	(1 << 12)	/* bulk bytes written before keys again */
+#define PASTE_CHUNK	(1 << 16)	/* paste bytes queued at a time */
+
+enum { LANE_KEY, LANE_BULK, LANE_NUM };
+
+typedef struct {
+	char *buf;
+	size_t off, len, cap; /* off to len is still to be written */
+} Lane;
+
+typedef struct {
+	char *buf;
+	size_t off, len;      /* off to len is still to be queued */
+	int crlf, echo;       /* terminal modes when it was pasted */
+	int brackets;         /* 0, or 1 and 2 before and after the start */
+} Paste;
+
+static void *reader(void *);
+static void readtty(int, int, void *);
+static void blink(Timer *);
+static void syncend(Timer *);
+static void *parser(void *);
+static size_t parse(void);
+static void waitdata(size_t);
+static void waitspace(void);
+static void wakeparser(void);
+static void queue(const char *, size_t);
+static void laneput(Lane *, const char *, size_t);
+static void flush(void);
+static void pastefill(void);
+static size_t bulkleft(void);
+static size_t pastecopy(char *, const char *, size_t, int);
+static void growring(void);
+static void publish(void);
+static double nowms(void);
+static int histbin(size_t);
+
+extern Term term;
+
+static int ttyfd;
+static Ring ring;
+
+/* the terminal, taken by the parser for each slice of input */
+static pthread_mutex_t termlock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int lockwanted;
+
+/* only for sleeping, the ring itself is lock free */
+static pthread_mutex_t waitlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t moredata = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t morespace = PTHREAD_COND_INITIALIZER;
+static atomic_int parserwaits, readerwaits;
+
+/* set by the reader at end of file or on an error */
+static atomic_int readdone;
+static int readerr;
+
+/* the write queue, filled holding the terminal, written by the reader */
+static pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+static Lane lanes[LANE_NUM];
+static atomic_size_t queued; /* bytes in all lanes */
+
+/* the paste streaming into LANE_BULK, see pastefill() */
+static pthread_mutex_t pastelock = PTHREAD_MUTEX_INITIALIZER;
+static Paste paste;
+static atomic_int pasting;
+
+/* blinking text, toggled on the reader's loop while there is any */
+static Timer blinktimer = { .fn = blink };
+static atomic_int blinkstart;
+
+/* ends a synchronized update that ran past synctimeout */
+static Timer synctimer = { .fn = syncend };
+static atomic_int syncstart;
+
+/* when to draw, fed holding the terminal and read by the renderer */
+static pthread_mutex_t pacelock = PTHREAD_MUTEX_INITIALIZER;
+static Pace pace;
+static size_t unpublished; /* bytes parsed since the last publish */
+static size_t syncheld;    /* of those, held by a synchronized update */
+
+/* see pipestat(), counted by the reader */
+static atomic_size_t nread[PIPE_HISTBINS], nwakeup[PIPE_HISTBINS];
+static atomic_size_t nbytes, ringsize, nsynced;
+
+void
+pipestart(int fd)
+{
+	pthread_attr_t attr;
+	pthread_t t;
+
+	ttyfd = fd;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		die("fcntl O_NONBLOCK failed: %s\n", strerror(errno));
+	evinit();
+	ringinit(&ring, RING_MIN);
+	atomic_store(&ringsize, ring.size);
+	ttyhandoff(queue);
+	paceinit(&pace, minlatency, maxlatency);
+	publish(); /* the screen before the shell wrote anything */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&t, &attr, reader, NULL) != 0 ||
+	    pthread_create(&t, &attr, parser, NULL) != 0)
+		die("pthread_create failed: %s\n", strerror(errno));
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Holds off the parser. The parser gives way at the end of the slice it
+ * is in, so this waits for at most PARSE_SLICE bytes of parsing.
+ */
+void
+pipelock(void)
+{
+	atomic_fetch_add(&lockwanted, 1);
+	pthread_mutex_lock(&termlock);
+	atomic_fetch_sub(&lockwanted, 1);
+}
+
+void
+pipeunlock(void)
+{
+	publish();
+	pthread_mutex_unlock(&termlock);
+}
+
+/*
+ * Whether the renderer draws at this display tick, see pace.c. It has to
+ * be asked on every tick, a tick it says no to is skipped.
+ */
+int
+pipeframe(void)
+{
+	int r;
+
+	pthread_mutex_lock(&pacelock);
+	r = pacedue(&pace, nowms());
+	pthread_mutex_unlock(&pacelock);
+
+	return r;
+}
+
+void
+pipepacestat(PaceStat *st)
+{
+	pthread_mutex_lock(&pacelock);
+	*st = pace.st;
+	pthread_mutex_unlock(&pacelock);
+}
+
+/* ttywrite() for keys from other threads, it only queues the bytes */
+void
+pipewrite(const char *s, size_t n)
+{
+	pipelock();
+	ttywrite(s, n, 1);
+	pipeunlock();
+}
+
+/*
+ * Pastes n bytes from s, after anything typed meanwhile. The text is
+ * copied and streamed out by the reader thread, see pastefill(), a
+ * paste while another one is going on is added to its end.
+ */
+void
+pipepaste(const char *s, size_t n)
+{
+	int crlf, echo, brackets;
+
+	pipelock();
+	crlf = IS_SET(MODE_CRLF);
+	echo = IS_SET(MODE_ECHO);
+	brackets = IS_SET(MODE_PASTE);
+	pipeunlock();
+
+	pthread_mutex_lock(&pastelock);
+	if (paste.buf == NULL) {
+		paste = (Paste){ .crlf = crlf, .echo = echo,
+		                 .brackets = brackets };
+	} else if (paste.off > 0) {
+		memmove(paste.buf, paste.buf + paste.off,
+		        paste.len - paste.off);
+		paste.len -= paste.off;
+		paste.off = 0;
+	}
+	paste.buf = xrealloc(paste.buf, paste.len + n);
+	memcpy(paste.buf + paste.len, s, n);
+	paste.len += n;
+	atomic_store(&pasting, 1);
+	pthread_mutex_unlock(&pastelock);
+
+	evwake();
+}
+
+/* drops what is left of the paste, what is queued already goes out */
+void
+pipepastecancel(void)
+{
+	pthread_mutex_lock(&pastelock);
+	if (paste.buf != NULL) {
+		if (paste.brackets == 2) {
+			pthread_mutex_lock(&queuelock);
+			laneput(&lanes[LANE_BULK], "\033[201~", 6);
+			pthread_mutex_unlock(&queuelock);
+		}
+		free(paste.buf);
+		paste = (Paste){ 0 };
+		atomic_store(&pasting, 0);
+	}
+	pthread_mutex_unlock(&pastelock);
+
+	evwake();
+}
+
+/*
+ * Whether a paste is going on, with how much of it was queued so far
+ * and its size in *done and *total when they are not NULL.
+ */
+int
+pipepasting(size_t *done, size_t *total)
+{
+	int r;
+
+	pthread_mutex_lock(&pastelock);
+	if ((r = paste.buf != NULL)) {
+		if (done)
+			*done = paste.off;
+		if (total)
+			*total = paste.len;
+	}
+	pthread_mutex_unlock(&pastelock);
+
+	return r;
+}
+
+/*
+ * Queues the next PASTE_CHUNK bytes of the paste, with '\n' turned into
+ * '\r' as the terminal world expects and inside the bracketed paste
+ * markers if the application asked for them.
+ */
+void
+pastefill(void)
+{
+	static char chunk[2 * PASTE_CHUNK];
+	size_t n, k;
+
+	pthread_mutex_lock(&pastelock);
+	if (paste.buf == NULL) {
+		pthread_mutex_unlock(&pastelock);
+		return;
+	}
+	n = MIN(paste.len - paste.off, PASTE_CHUNK);
+	if (paste.off + n < paste.len) {
+		/* the next chunk starts with a whole UTF-8 sequence */
+		for (k = n; k > 0 && (paste.buf[paste.off + k] & 0xC0) == 0x80;
+		     k--)
+			;
+		if (k > 0)
+			n = k;
+	}
+	k = pastecopy(chunk, paste.buf + paste.off, n, paste.crlf);
+	paste.off += n;
+	if (paste.echo) {
+		pipelock();
+		twrite(chunk, k, 1);
+		pipeunlock();
+	}
+
+	pthread_mutex_lock(&queuelock);
+	if (paste.brackets == 1) {
+		laneput(&lanes[LANE_BULK], "\033[200~", 6);
+		paste.brackets = 2;
+	}
+	laneput(&lanes[LANE_BULK], chunk, k);
+	if (paste.off == paste.len) {
+		if (paste.brackets == 2)
+			laneput(&lanes[LANE_BULK], "\033[201~", 6);
+		free(paste.buf);
+		paste = (Paste){ 0 };
+		atomic_store(&pasting, 0);
+	}
+	pthread_mutex_unlock(&queuelock);
+	pthread_mutex_unlock(&pastelock);
+}
+
+/*
+ * Copies n bytes from src to dst turning '\n' into '\r', 16 at a time
+ * where the target allows. In MODE_CRLF a '\r' goes out as "\r\n" like
+ * ttywrite() does, so dst needs room for twice n. Returns the bytes in
+ * dst.
+ */
+size_t
+pastecopy(char *dst, const char *src, size_t n, int crlf)
+{
+	size_t i = 0, k = 0;
+
+	if (crlf) {
+		for (; i < n; i++) {
+			if (src[i] == '\n' || src[i] == '\r') {
+				dst[k++] = '\r';
+				dst[k++] = '\n';
+			} else {
+				dst[k++] = src[i];
+			}
+		}
+		return k;
+	}
+
+#if defined(__SSE2__)
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\n' ^ '\r');
+	__m128i v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		v = _mm_xor_si128(v, _mm_and_si128(_mm_cmpeq_epi8(v, nl), cr));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t nl = vdupq_n_u8('\n');
+	const uint8x16_t cr = vdupq_n_u8('\n' ^ '\r');
+	uint8x16_t v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = vld1q_u8((const uint8_t *)src + i);
+		v = veorq_u8(v, vandq_u8(vceqq_u8(v, nl), cr));
+		vst1q_u8((uint8_t *)dst + i, v);
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = (src[i] == '\n') ? '\r' : src[i];
+	return n;
+}
+
+/* what ttywrite() writes once handed off, called holding the terminal */
+void
+queue(const char *s, size_t n)
+{
+	pthread_mutex_lock(&queuelock);
+	laneput(&lanes[LANE_KEY], s, n);
+	pthread_mutex_unlock(&queuelock);
+
+	evwake();
+}
+
+size_t
+bulkleft(void)
+{
+	size_t n;
+
+	pthread_mutex_lock(&queuelock);
+	n = lanes[LANE_BULK].len - lanes[LANE_BULK].off;
+	pthread_mutex_unlock(&queuelock);
+
+	return n;
+}
+
+/* appends to l, holding queuelock */
+void
+laneput(Lane *l, const char *s, size_t n)
+{
+	if (l->len + n > l->cap && l->off > 0) {
+		memmove(l->buf, l->buf + l->off, l->len - l->off);
+		l->len -= l->off;
+		l->off = 0;
+	}
+	if (l->len + n > l->cap) {
+		l->cap = MAX(l->len + n, 2 * l->cap);
+		l->buf = xrealloc(l->buf, l->cap);
+	}
+	memcpy(l->buf + l->len, s, n);
+	l->len += n;
+	atomic_fetch_add(&queued, n);
+}
+
+/*
+ * Writes the lanes out until they are empty or the pty is full, all of
+ * LANE_KEY before each chunk of LANE_BULK.
+ */
+void
+flush(void)
+{
+	Lane *l;
+	size_t n;
+	ssize_t r;
+
+	pthread_mutex_lock(&queuelock);
+	for (;;) {
+		l = &lanes[LANE_KEY];
+		if (l->off == l->len)
+			l = &lanes[LANE_BULK];
+		if (l->off == l->len)
+			break;
+		n = l->len - l->off;
+		if (l == &lanes[LANE_BULK] && n > WQ_CHUNK) {
+			/* keys may follow, do not split a UTF-8 sequence */
+			for (n = WQ_CHUNK; n > 0 &&
+			     (l->buf[l->off + n] & 0xC0) == 0x80; n--)
+				;
+			if (n == 0)
+				n = WQ_CHUNK;
+		}
+		if ((r = write(ttyfd, l->buf + l->off, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			die("write error on tty: %s\n", strerror(errno));
+		}
+		l->off += r;
+		if (l->off == l->len)
+			l->off = l->len = 0;
+		atomic_fetch_sub(&queued, r);
+	}
+	pthread_mutex_unlock(&queuelock);
+}
+
+void
+pipestat(PipeStat *st)
+{
+	int i;
+
+	st->ring = atomic_load_explicit(&ringsize, memory_order_relaxed);
+	st->bytes = atomic_load_explicit(&nbytes, memory_order_relaxed);
+	st->synced = atomic_load_explicit(&nsynced, memory_order_relaxed);
+	for (i = 0; i < PIPE_HISTBINS; i++) {
+		st->reads[i] = atomic_load_explicit(&nread[i],
+		                                    memory_order_relaxed);
+		st->wakeups[i] = atomic_load_explicit(&nwakeup[i],
+		                                      memory_order_relaxed);
+	}
+}
+
+/* the bin of n, floor(log2(n)) up to the last one */
+int
+histbin(size_t n)
+{
+	int b;
+
+	for (b = 0; n > 1 && b < PIPE_HISTBINS - 1; n >>= 1)
+		b++;
+	return b;
+}
+
+void *
+reader(void *arg)
+{
+	while (!atomic_load(&readdone)) {
+		/* keep the bulk lane fed while a paste streams in */
+		if (atomic_load(&pasting) && bulkleft() < PASTE_CHUNK)
+			pastefill();
+		if (atomic_load(&queued))
+			flush();
+		if (atomic_exchange(&blinkstart, 0) && blinktimeout &&
+		    !evarmed(&blinktimer))
+			evtimer(&blinktimer, blinktimeout);
+		if (atomic_exchange(&syncstart, 0))
+			evtimer(&synctimer, synctimeout);
+
+		/* what flush() could not write goes once the pty takes more */
+		evwatch(ttyfd, EV_READ | (atomic_load(&queued) ? EV_WRITE : 0),
+		        readtty, NULL);
+		evpoll();
+	}
+	return NULL;
+}
+
+/* drains the pty into the ring, up to the budget */
+void
+readtty(int fd, int ready, void *arg)
+{
+	struct timespec start, now;
+	char *p;
+	size_t n, got;
+	ssize_t r;
+
+	if (!(ready & EV_READ))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (got = 0; !readbudget || got < readbudget; ) {
+		if ((n = ringspace(&ring, &p)) == 0) {
+			if (ring.size < RING_MAX) {
+				growring();
+				continue;
+			}
+			wakeparser();
+			waitspace();
+			continue;
+		}
+		if ((r = read(fd, p, n)) < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			break;
+		if (r <= 0) {
+			readerr = (r < 0) ? errno : 0;
+			atomic_store(&readdone, 1);
+			break;
+		}
+		ringpush(&ring, r);
+		got += r;
+		atomic_fetch_add_explicit(&nread[histbin(r)], 1,
+		                          memory_order_relaxed);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (readbudgetms && TIMEDIFF(now, start) >= readbudgetms)
+			break;
+	}
+	atomic_fetch_add_explicit(&nwakeup[histbin(got)], 1,
+	                          memory_order_relaxed);
+	atomic_fetch_add_explicit(&nbytes, got, memory_order_relaxed);
+
+	wakeparser();
+}
+
+/*
+ * Toggles blinking text every blinktimeout ms, new text starts visible.
+ * The phase goes to the renderer in the snapshot, see Frame.blinkoff.
+ * It keeps going while text may still be written blinking.
+ */
+void
+blink(Timer *t)
+{
+	pipelock();
+	if (tattrset(ATTR_BLINK)) {
+		term.mode ^= MODE_BLINKOFF;
+		tsetdirtattr(ATTR_BLINK);
+	} else {
+		term.mode &= ~MODE_BLINKOFF;
+	}
+	if (tattrset(ATTR_BLINK) || (term.c.attr.mode & ATTR_BLINK))
+		evtimer(t, blinktimeout);
+	pipeunlock();
+}
+
+/*
+ * The application did not end its synchronized update in time, show
+ * what it drew so far. A later update starts the timer again.
+ */
+void
+syncend(Timer *t)
+{
+	pipelock();
+	term.mode &= ~MODE_SYNC;
+	pipeunlock();
+}
+
+void *
+parser(void *arg)
+{
+	size_t left = 0;
+
+	for (;;) {
+		waitdata(left);
+		pthread_mutex_lock(&termlock);
+		left = parse();
+		publish();
+		if (blinkset) {
+			blinkset = 0;
+			atomic_store(&blinkstart, 1);
+			evwake();
+		}
+		if (syncset) {
+			syncset = 0;
+			atomic_store(&syncstart, 1);
+			evwake();
+		}
+		pthread_mutex_unlock(&termlock);
+
+		/* the shell is gone once everything it wrote is on screen */
+		if (atomic_load(&readdone) && ringlen(&ring) == left) {
+			if (readerr)
+				die("couldn't read from shell: %s\n",
+				    strerror(readerr));
+			exit(0);
+		}
+
+		/* let a waiting pipelock() in before taking the lock again */
+		while (atomic_load(&lockwanted) > 0)
+			sched_yield();
+	}
+}
+
+/*
+ * Feeds the ring to twrite() until it is empty, PARSE_MAX bytes were
+ * parsed or someone waits for the lock. Returns how many bytes are left
+ * because they end in an incomplete UTF-8 sequence, 0 otherwise.
+ */
+size_t
+parse(void)
+{
+	char tmp[UTF_SIZ];
+	const char *p;
+	size_t n, w, k, done;
+
+	for (done = 0; done < PARSE_MAX; done += w) {
+		if ((n = ringdata(&ring, &p)) == 0)
+			return 0;
+		w = twrite(p, MIN(n, PARSE_SLICE), 0);
+		if (w == 0) {
+			/* a sequence cut by the end of the buffer or the slice */
+			k = ringpeek(&ring, 0, tmp, sizeof(tmp));
+			if ((w = twrite(tmp, k, 0)) == 0)
+				return k;
+		}
+		ringpop(&ring, w);
+		unpublished += w;
+
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load(&readerwaits)) {
+			pthread_mutex_lock(&waitlock);
+			pthread_cond_signal(&morespace);
+			pthread_mutex_unlock(&waitlock);
+		}
+		if (atomic_load(&lockwanted) > 0)
+			break;
+	}
+
+	return 0;
+}
+
+void
+wakeparser(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&parserwaits)) {
+		pthread_mutex_lock(&waitlock);
+		pthread_cond_signal(&moredata);
+		pthread_mutex_unlock(&waitlock);
+	}
+}
+
+/* a snapshot, and its time and size for the pacing, holding the terminal */
+void
+publish(void)
+{
+	if (IS_SET(MODE_SYNC)) {
+		/* count each publish held back with new input */
+		if (unpublished > syncheld)
+			atomic_fetch_add_explicit(&nsynced, 1,
+			                          memory_order_relaxed);
+		syncheld = unpublished;
+		return;
+	}
+	if (!snappublish())
+		return;
+	/* a synchronized update is complete once it ends, draw it at once */
+	pthread_mutex_lock(&pacelock);
+	pacechange(&pace, nowms(), syncheld ? 0 : unpublished);
+	pthread_mutex_unlock(&pacelock);
+	unpublished = syncheld = 0;
+}
+
+double
+nowms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * The parser only touches the ring holding the terminal, so taking it
+ * keeps the parser out while the data moves. It gives way as it does
+ * for pipelock().
+ */
+void
+growring(void)
+{
+	atomic_fetch_add(&lockwanted, 1);
+	pthread_mutex_lock(&termlock);
+	atomic_fetch_sub(&lockwanted, 1);
+	ringgrow(&ring, ring.size * 2);
+	pthread_mutex_unlock(&termlock);
+	atomic_store(&ringsize, ring.size);
+}
+
+/*
+ * waits until more than n bytes are in the ring or the reader is done,
+ * or a bit when a snapshot could not be published
+ */
+void
+waitdata(size_t n)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&waitlock);
+	atomic_store(&parserwaits, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (ringlen(&ring) <= n && !atomic_load(&readdone)) {
+		if (!snappending()) {
+			pthread_cond_wait(&moredata, &waitlock);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PUBLISH_RETRY;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&moredata, &waitlock, &ts);
+		break;
+	}
+	atomic_store(&parserwaits, 0);
+	pthread_mutex_unlock(&waitlock);
+}
+
+void
+waitspace(void)
+{
+	char *p;
+
+	pthread_mutex_lock(&waitlock);
+	atomic_store(&readerwaits, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (ringspace(&ring, &p) == 0)
+		pthread_cond_wait(&morespace, &waitlock);
+	atomic_store(&readerwaits, 0);
+	pthread_mutex_unlock(&waitlock);
+}
@@ -0,0 +1,36 @@
+//
+//  pipeline.h
+//  FTerm
+//
+//  Reader and parser threads between the pty and the renderer, see
+//  pipeline.c
+//
+
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <stddef.h>
+#include "pace.h"
+
+#define PIPE_HISTBINS	21	/* log2 bins, the last from 1MB up */
+
+typedef struct {
+	size_t ring;                   /* bytes the ring holds now */
+	size_t bytes;                  /* bytes read from the pty */
+	size_t synced;                 /* publishes held by synchronized updates */
+	size_t reads[PIPE_HISTBINS];   /* reads by log2 of their size */
+	size_t wakeups[PIPE_HISTBINS]; /* wakeups by log2 of bytes read */
+} PipeStat;
+
+void pipestart(int);
+void pipelock(void);
+void pipeunlock(void);
+void pipewrite(const char *, size_t);
+void pipepaste(const char *, size_t);
+void pipepastecancel(void);
+int pipepasting(size_t *, size_t *);
+void pipestat(PipeStat *);
+int pipeframe(void);
+void pipepacestat(PaceStat *);
+
+#endif /* pipeline_h */
@@ -0,0 +1,135 @@
+//
+//  ring.c
+//  FTerm
+//
+//  Byte ring shared by exactly one producer and one consumer thread,
+//  without locks. Each side only moves its own counter. The producer
+//  fills the contiguous space handed out by ringspace() in place, e.g.
+//  with read(2), and publishes it with ringpush(). The consumer works on
+//  the data handed out by ringdata() in place and releases it with
+//  ringpop(). Waiting for data or space is up to the caller.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "st.h"
+#include "ring.h"
+
+static size_t ringround(size_t);
+
+/* the counters are masked, so sizes are rounded to a power of 2 */
+size_t
+ringround(size_t size)
+{
+	size_t n;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+	return n;
+}
+
+void
+ringinit(Ring *r, size_t size)
+{
+	r->size = ringround(size);
+	r->buf = xmalloc(r->size);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+/*
+ * Moves the data to a buffer of size bytes, which has to hold it. The
+ * counters stay, so ringlen() can still be called meanwhile, but neither
+ * side may use anything else of the ring.
+ */
+void
+ringgrow(Ring *r, size_t size)
+{
+	char *buf;
+	size_t len, tail, i, k, off;
+
+	size = ringround(size);
+	buf = xmalloc(size);
+	len = ringlen(r);
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	for (i = 0; i < len; i += k) {
+		off = (tail + i) & (size - 1);
+		k = ringpeek(r, i, buf + off, MIN(len - i, size - off));
+	}
+	free(r->buf);
+	r->buf = buf;
+	r->size = size;
+}
+
+/* bytes ready for the consumer, from either side */
+size_t
+ringlen(Ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) -
+	       atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/* producer: the free space up to the end of the buffer, in *p */
+size_t
+ringspace(Ring *r, char **p)
+{
+	size_t head, tail, off;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	off = head & (r->size - 1);
+	*p = r->buf + off;
+
+	return MIN(r->size - (head - tail), r->size - off);
+}
+
+/* producer: hand n bytes written at ringspace() to the consumer */
+void
+ringpush(Ring *r, size_t n)
+{
+	atomic_fetch_add_explicit(&r->head, n, memory_order_release);
+}
+
+/* consumer: the data up to the end of the buffer, in *p */
+size_t
+ringdata(Ring *r, const char **p)
+{
+	size_t head, tail, off;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	off = tail & (r->size - 1);
+	*p = r->buf + off;
+
+	return MIN(head - tail, r->size - off);
+}
+
+/*
+ * consumer: copies up to n bytes from off bytes into the data to dst,
+ * going on at the start of the buffer. Returns the bytes copied.
+ */
+size_t
+ringpeek(Ring *r, size_t off, char *dst, size_t n)
+{
+	size_t len, tail, i, k;
+
+	len = ringlen(r);
+	if (off >= len)
+		return 0;
+	n = MIN(n, len - off);
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed) + off;
+	for (i = 0; i < n; i += k) {
+		k = MIN(n - i, r->size - ((tail + i) & (r->size - 1)));
+		memcpy(dst + i, r->buf + ((tail + i) & (r->size - 1)), k);
+	}
+
+	return n;
+}
+
+/* consumer: give n bytes from ringdata() back to the producer */
+void
+ringpop(Ring *r, size_t n)
+{
+	atomic_fetch_add_explicit(&r->tail, n, memory_order_release);
+}
@@ -0,0 +1,30 @@
+//
+//  ring.h
+//  FTerm
+//
+//  Single producer, single consumer byte ring, see ring.c
+//
+
+#ifndef ring_h
+#define ring_h
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct {
+	char *buf;
+	size_t size;          /* a power of two */
+	_Atomic size_t head;  /* bytes ever pushed, moved by the producer */
+	_Atomic size_t tail;  /* bytes ever popped, moved by the consumer */
+} Ring;
+
+void ringinit(Ring *, size_t);
+void ringgrow(Ring *, size_t);
+size_t ringlen(Ring *);
+size_t ringspace(Ring *, char **);
+void ringpush(Ring *, size_t);
+size_t ringdata(Ring *, const char **);
+size_t ringpeek(Ring *, size_t, char *, size_t);
+void ringpop(Ring *, size_t);
+
+#endif /* ring_h */
@@ -0,0 +1,256 @@
+//
+//  search.c
+//  FTerm
+//
+//  Search of the screen and the history. Lines are searched as logical
+//  lines, a match may go on into the lines a line wraps into. History
+//  blocks that do not hold every trigram of the pattern are skipped
+//  without being decoded, the lines left are scanned for the pattern.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "hist.h"
+#include "search.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+ #include <immintrin.h>
+#elif defined(__ARM_NEON)
+ #include <arm_neon.h>
+#endif
+
+static const Glyph *searchline(int);
+static int linetext(int);
+static int lsearch(const Rune *, int, int, int, int);
+static int runefind(const Rune *, int, const Rune *, int);
+
+extern Term term;
+
+/* runes of the lines searched, with the cells they came from */
+static Rune *txt;
+static int *tx, *tw, *ty;
+static int ntxt, txtsiz;
+
+/*
+ * Find the first match of pat after (x, y) for dir > 0, or the last one
+ * before it otherwise. Returns 0 if there is none.
+ */
+int
+tsearch(const Rune *pat, int len, int x, int y, int dir, Match *m)
+{
+	HistQuery q;
+	int top, n, k;
+
+	if (len <= 0)
+		return 0;
+	dir = dir > 0 ? 1 : -1;
+	histquery(&q, pat, len);
+	top = IS_SET(MODE_ALTSCREEN) ? 0 : -histlines();
+	LIMIT(y, top, term.row - 1);
+
+	for (;;) {
+		if (y < 0) {
+			/* history lines are numbered from the newest */
+			n = histskip(-y - 1, -dir, &q);
+			if (n < 0 && dir < 0)
+				return 0;
+			if (n < 0) {
+				y = 0;
+				x = -1;
+			} else if (-n - 1 != y) {
+				y = -n - 1;
+				x = dir > 0 ? -1 : term.col;
+			}
+		}
+		if ((k = lsearch(pat, len, x, y, dir)) >= 0) {
+			m->x0 = tx[k];
+			m->y0 = ty[k];
+			m->x1 = tx[k + len - 1] + tw[k + len - 1] - 1;
+			m->y1 = ty[k + len - 1];
+			return 1;
+		}
+		y += dir;
+		x = dir > 0 ? -1 : term.col;
+		if (y < top || y >= term.row)
+			return 0;
+	}
+}
+
+/*
+ * Scroll the view to m when it is out of it, to the middle of the rows
+ * shown, and select it. Rows in view are the rows of m moved down by
+ * the history lines shown.
+ */
+void
+searchshow(const Match *m)
+{
+	int scr = term.scr;
+
+	if (m->y0 + scr < 0 || m->y1 + scr >= term.row)
+		scr = MAX(term.row / 2 - m->y0, 0);
+	if (scr > term.scr)
+		kscrollup(&(Arg){ .i = scr - term.scr });
+	else if (scr < term.scr)
+		kscrolldown(&(Arg){ .i = term.scr - scr });
+
+	selstart(m->x0, m->y0 + term.scr, 0);
+	selextend(m->x1, m->y1 + term.scr, SEL_REGULAR, 0);
+	selextend(m->x1, m->y1 + term.scr, SEL_REGULAR, 1);
+}
+
+const Glyph *
+searchline(int y)
+{
+	static Glyph *buf;
+	static int bufsiz;
+
+	if (y >= 0)
+		return y < term.row ? term.line[y] : NULL;
+	if (IS_SET(MODE_ALTSCREEN))
+		return NULL;
+	if (bufsiz < term.col) {
+		buf = xrealloc(buf, term.col * sizeof(*buf));
+		bufsiz = term.col;
+	}
+	return histline(-y - 1, buf, term.col) ? buf : NULL;
+}
+
+/* append the text of line y to txt, returns whether the line wraps */
+int
+linetext(int y)
+{
+	const Glyph *gp;
+	int x, len, wrap;
+
+	if ((gp = searchline(y)) == NULL)
+		return 0;
+	len = term.col;
+	if (!(wrap = gp[len - 1].mode & ATTR_WRAP)) {
+		while (len > 0 && gp[len - 1].u == ' ')
+			len--;
+	}
+
+	if (ntxt + len > txtsiz) {
+		txtsiz = ntxt + len;
+		txt = xrealloc(txt, txtsiz * sizeof(*txt));
+		tx = xrealloc(tx, txtsiz * sizeof(*tx));
+		tw = xrealloc(tw, txtsiz * sizeof(*tw));
+		ty = xrealloc(ty, txtsiz * sizeof(*ty));
+	}
+	for (x = 0; x < len; x++) {
+		if (gp[x].mode & ATTR_WDUMMY)
+			continue;
+		txt[ntxt] = gp[x].u;
+		tx[ntxt] = x;
+		tw[ntxt] = (gp[x].mode & ATTR_WIDE) ? 2 : 1;
+		ty[ntxt] = y;
+		ntxt++;
+	}
+	return wrap;
+}
+
+/*
+ * Search the matches starting in line y, right of x for dir > 0 and
+ * left of it otherwise. Returns the index in txt of the match, or -1.
+ */
+int
+lsearch(const Rune *pat, int len, int x, int y, int dir)
+{
+	int first, wrap, yy, s, k, best = -1;
+
+	ntxt = 0;
+	wrap = linetext(y);
+	first = ntxt;
+	for (yy = y; wrap && ntxt < first + len - 1 && ++yy < term.row; )
+		wrap = linetext(yy);
+
+	for (s = 0; s < first; s = k + 1) {
+		if ((k = runefind(txt + s, ntxt - s, pat, len)) < 0)
+			break;
+		k += s;
+		if (k >= first)
+			break;
+		if (dir > 0 && tx[k] > x)
+			return k;
+		if (dir < 0) {
+			if (tx[k] >= x)
+				break;
+			best = k;
+		}
+	}
+	return best;
+}
+
+/*
+ * Returns the index of the first p in s or -1. Candidates are the
+ * positions where both the first and the last rune of p match, tested
+ * 8 or 4 at a time where the target allows it.
+ */
+int
+runefind(const Rune *s, int n, const Rune *p, int m)
+{
+	int i = 0, j;
+
+	if (m > n)
+		return -1;
+
+#if defined(__AVX2__)
+	const __m256i f = _mm256_set1_epi32(p[0]), l = _mm256_set1_epi32(p[m-1]);
+
+	for (; i + m - 1 + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+		uint32_t c = _mm256_movemask_ps(_mm256_castsi256_ps(
+		                 _mm256_and_si256(_mm256_cmpeq_epi32(a, f),
+		                                  _mm256_cmpeq_epi32(b, l))));
+
+		for (; c; c &= c - 1) {
+			j = i + __builtin_ctz(c);
+			if (!memcmp(s + j, p, m * sizeof(Rune)))
+				return j;
+		}
+	}
+#elif defined(__SSE2__)
+	const __m128i f = _mm_set1_epi32(p[0]), l = _mm_set1_epi32(p[m-1]);
+
+	for (; i + m - 1 + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+		uint32_t c = _mm_movemask_ps(_mm_castsi128_ps(
+		                 _mm_and_si128(_mm_cmpeq_epi32(a, f),
+		                               _mm_cmpeq_epi32(b, l))));
+
+		for (; c; c &= c - 1) {
+			j = i + __builtin_ctz(c);
+			if (!memcmp(s + j, p, m * sizeof(Rune)))
+				return j;
+		}
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t f = vdupq_n_u32(p[0]), l = vdupq_n_u32(p[m-1]);
+	uint32_t c[4];
+
+	for (; i + m - 1 + 4 <= n; i += 4) {
+		uint32x4_t v = vandq_u32(vceqq_u32(vld1q_u32(s + i), f),
+		                         vceqq_u32(vld1q_u32(s + i + m - 1), l));
+
+		if (vmaxvq_u32(v) == 0)
+			continue;
+		vst1q_u32(c, v);
+		for (j = 0; j < 4; j++) {
+			if (c[j] && !memcmp(s + i + j, p, m * sizeof(Rune)))
+				return i + j;
+		}
+	}
+#endif
+
+	for (; i + m <= n; i++) {
+		if (s[i] == p[0] && !memcmp(s + i, p, m * sizeof(Rune)))
+			return i;
+	}
+	return -1;
+}
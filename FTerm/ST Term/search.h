@@ -0,0 +1,26 @@
+//
+//  search.h
+//  FTerm
+//
+//  Search of the screen and scrollback, see search.c
+//
+
+#ifndef search_h
+#define search_h
+
+#include "st.h"
+
+/*
+ * A match from (x0, y0) to (x1, y1), both included. Rows from 0 are on
+ * screen, row -1 is the newest line of the history, -2 the one before
+ * it and so on. searchshow() selects it.
+ */
+typedef struct {
+	int x0, y0;
+	int x1, y1;
+} Match;
+
+int tsearch(const Rune *, int, int, int, int, Match *);
+void searchshow(const Match *);
+
+#endif /* search_h */
@@ -0,0 +1,404 @@
+//
+//  snap.c
+//  FTerm
+//
+//  Snapshots of the screen for readers that do not hold the terminal,
+//  like the renderer. Whoever changes the terminal publishes a Frame
+//  with snappublish() when it is done, which copies the cells changed
+//  since into one of NFRAME frames. A reader claims the last published
+//  frame with a counter instead of a lock and copies out of it with
+//  snapread(), only the rows that changed since its own copy.
+//
+//  The writer only writes a frame that is not the last published one
+//  and that no reader has claimed, so a reader never sees a frame half
+//  written and neither side waits for the other. When every frame is
+//  claimed the publish is left pending, snappending(), and the changes
+//  go into the next one. Publishing copies the dirty rows into the
+//  frame written, and whatever the frame missed while others were
+//  written, so its cost follows the damage rather than the screen.
+//  Likewise only the styles from the lowest one written since are
+//  copied, see stylesince().
+//
+//  A scroll moves the rows a frame or a reader already has instead of
+//  marking the screen changed, only the rows coming in are copied.
+//  Frame.scrolls counts the rows scrolled, a frame or a reader behind
+//  the writer by less than a screen moves its rows by the difference.
+//
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "macos_support.h"
+#include "snap.h"
+
+#define NFRAME	3	/* last published, one being read, one to write */
+
+static void snapresize(void);
+static void rowshift(void *, int, size_t, int, const void *);
+static int stylesince(const StyleMark *, uint64_t);
+
+extern Term term;
+extern MacOS_Cursor macos_cursor;
+extern int macos_palette_dirty;
+extern int macos_scrolled;
+
+static Frame frames[NFRAME];
+static atomic_int readers[NFRAME];
+static atomic_int writing[NFRAME];
+static atomic_int front = -1;
+static atomic_int pending;
+
+/* the writer's side, touched only holding the terminal */
+static Span *behind[NFRAME]; /* columns each frame lacks, per row */
+static Span *pend;           /* damage not published yet */
+static uint64_t *rowgen;
+static Span *sel;
+static MacOS_Cursor cursor;
+static uint64_t gen, selgen, stylegen = 1, palettegen;
+static int64_t scrolls;
+static StyleMark stylelog[SNAP_STYLELOG];
+static unsigned int nstylelog;
+static int row, col, stale, blinkoff;
+static const Span none = { INT_MAX, -1 };
+
+/* moves rows of siz bytes up by n, or down by -n, new ones are set to in */
+void
+rowshift(void *a, int rows, size_t siz, int n, const void *in)
+{
+	char *p = a;
+	int y, k = MIN(abs(n), rows);
+
+	if (n > 0)
+		memmove(p, p + k * siz, (rows - k) * siz);
+	else
+		memmove(p + k * siz, p, (rows - k) * siz);
+	if (in == NULL)
+		return;
+	for (y = (n > 0) ? rows - k : 0; k > 0; k--, y++)
+		memcpy(p + y * siz, in, siz);
+}
+
+/* a new size, every frame has to be written in full */
+void
+snapresize(void)
+{
+	int k, y;
+
+	row = term.row;
+	col = term.col;
+	pend = xrealloc(pend, row * sizeof(*pend));
+	rowgen = xrealloc(rowgen, row * sizeof(*rowgen));
+	sel = xrealloc(sel, row * sizeof(*sel));
+	for (k = 0; k < NFRAME; k++)
+		behind[k] = xrealloc(behind[k], row * sizeof(*behind[k]));
+	for (y = 0; y < row; y++) {
+		pend[y] = (Span){ 0, col - 1 };
+		sel[y] = none;
+		for (k = 0; k < NFRAME; k++)
+			behind[k][y] = none;
+	}
+	selgen = gen + 1;
+	stale = 1;
+}
+
+/*
+ * Publishes what changed on the terminal since the last call. It has to
+ * be called by whoever changes the terminal, holding it. Returns 1 when
+ * a frame with something new was published.
+ */
+int
+snappublish(void)
+{
+	Frame *f;
+	StyleMark *m;
+	Span s, all;
+	int64_t d;
+	int i, k, y, x0, x1, cur, lo;
+
+	if (term.row != row || term.col != col)
+		snapresize();
+
+	/* what draw() finds changed is what readers are missing */
+	draw();
+	if (macos_scrolled) {
+		/* but the rows they have move along, see rowshift() */
+		all = (Span){ 0, col - 1 };
+		rowshift(pend, row, sizeof(*pend), macos_scrolled, &all);
+		rowshift(rowgen, row, sizeof(*rowgen), macos_scrolled, NULL);
+		for (k = 0; k < NFRAME; k++)
+			rowshift(behind[k], row, sizeof(*behind[k]),
+			         macos_scrolled, &all);
+		scrolls += macos_scrolled;
+		macos_scrolled = 0;
+		stale = 1;
+	}
+	tdamagebegin();
+	while (tdamagenext(&y, &x0, &x1)) {
+		pend[y].x0 = MIN(pend[y].x0, x0);
+		pend[y].x1 = MAX(pend[y].x1, x1);
+		stale = 1;
+	}
+	tdamageend();
+
+	/* the marks name the gen of the next publish that goes through */
+	for (y = 0; y < row; y++) {
+		if (!selcols(y, &s.x0, &s.x1))
+			s = none;
+		if (s.x0 != sel[y].x0 || s.x1 != sel[y].x1) {
+			sel[y] = s;
+			selgen = gen + 1;
+			stale = 1;
+		}
+	}
+	if (styleslo < STYLE_MAX) {
+		stylegen = gen + 1;
+		/* publishes that did not go through share the mark */
+		m = &stylelog[(nstylelog - 1 + SNAP_STYLELOG) % SNAP_STYLELOG];
+		if (nstylelog == 0 || m->gen != stylegen) {
+			m = &stylelog[nstylelog++ % SNAP_STYLELOG];
+			*m = (StyleMark){ stylegen, STYLE_MAX };
+		}
+		m->lo = MIN(m->lo, styleslo);
+		styleslo = STYLE_MAX;
+		stale = 1;
+	}
+	if (macos_palette_dirty) {
+		macos_palette_dirty = 0;
+		palettegen = gen + 1;
+		stale = 1;
+	}
+	if (IS_SET(MODE_BLINKOFF) != blinkoff) {
+		blinkoff = IS_SET(MODE_BLINKOFF);
+		stale = 1;
+	}
+	if (memcmp(&cursor, &macos_cursor, sizeof(cursor))) {
+		cursor = macos_cursor;
+		stale = 1;
+	}
+	if (!stale)
+		return 0;
+
+	/* any frame but the last published that nobody reads */
+	cur = atomic_load(&front);
+	for (k = 0; k < NFRAME; k++) {
+		if (k == cur)
+			continue;
+		atomic_store(&writing[k], 1);
+		if (atomic_load(&readers[k]) == 0)
+			break;
+		atomic_store(&writing[k], 0);
+	}
+	if (k == NFRAME) {
+		atomic_store(&pending, 1);
+		return 0;
+	}
+
+	gen++;
+	for (y = 0; y < row; y++) {
+		if (pend[y].x0 > pend[y].x1)
+			continue;
+		rowgen[y] = gen;
+		for (i = 0; i < NFRAME; i++) {
+			behind[i][y].x0 = MIN(behind[i][y].x0, pend[y].x0);
+			behind[i][y].x1 = MAX(behind[i][y].x1, pend[y].x1);
+		}
+		pend[y] = none;
+	}
+
+	f = &frames[k];
+	if (f->row != row || f->col != col) {
+		f->row = row;
+		f->col = col;
+		f->line = xrealloc(f->line, row * col * sizeof(*f->line));
+		f->rowgen = xrealloc(f->rowgen, row * sizeof(*f->rowgen));
+		f->sel = xrealloc(f->sel, row * sizeof(*f->sel));
+		f->selgen = 0;
+	} else if ((d = scrolls - f->scrolls) != 0 && d > -row && d < row) {
+		/* behind has the rows coming in */
+		rowshift(f->line, row, col * sizeof(*f->line), d, NULL);
+		rowshift(f->rowgen, row, sizeof(*f->rowgen), d, NULL);
+	} else if (d != 0) {
+		for (y = 0; y < row; y++)
+			behind[k][y] = (Span){ 0, col - 1 };
+	}
+	f->scrolls = scrolls;
+	for (y = 0; y < row; y++) {
+		s = behind[k][y];
+		if (s.x0 > s.x1)
+			continue;
+		memcpy(f->line + y * col + s.x0, &TLINE(y)[s.x0],
+		       (s.x1 - s.x0 + 1) * sizeof(Glyph));
+		f->rowgen[y] = rowgen[y];
+		behind[k][y] = none;
+	}
+	if (f->selgen != selgen) {
+		memcpy(f->sel, sel, row * sizeof(*sel));
+		f->selgen = selgen;
+	}
+	if (f->stylegen != stylegen) {
+		if (f->styles == NULL)
+			f->styles = xmalloc(STYLE_MAX * sizeof(Style));
+		lo = stylesince(stylelog, f->stylegen);
+		memcpy(f->styles + lo, styles + lo,
+		       (nstyles - lo) * sizeof(Style));
+		memcpy(f->stylelog, stylelog, sizeof(stylelog));
+		f->nstyles = nstyles;
+		f->stylegen = stylegen;
+	}
+	f->cx = cursor.cx;
+	f->cy = cursor.cy;
+	f->cursormode = cursor.mode;
+	f->cursor = cursor.g;
+	f->palettegen = palettegen;
+	f->blinkoff = blinkoff;
+	f->scr = term.scr;
+	f->gen = gen;
+
+	atomic_store(&writing[k], 0);
+	atomic_store(&front, k);
+	atomic_store(&pending, 0);
+	stale = 0;
+	return 1;
+}
+
+/*
+ * The lowest style written by the publishes after since, going by log.
+ * When since is older than all log remembers any style may have changed
+ * and it is 0.
+ */
+int
+stylesince(const StyleMark *log, uint64_t since)
+{
+	int i, lo = STYLE_MAX, covered = 0;
+
+	for (i = 0; i < SNAP_STYLELOG; i++) {
+		if (log[i].gen > since)
+			lo = MIN(lo, log[i].lo);
+		else
+			covered = 1;
+	}
+	return covered ? lo : 0;
+}
+
+/* whether changes wait for a frame to be free, see snappublish() */
+int
+snappending(void)
+{
+	return atomic_load(&pending);
+}
+
+/*
+ * Brings dst up to the last published frame. Its rows are first moved up
+ * by dst->scroll rows for what scrolled since dst was last read, then
+ * only the rows that changed are copied and dst->damage has the columns
+ * that differ. dst starts zeroed. Returns 0 when nothing was published
+ * since.
+ */
+int
+snapread(Frame *dst)
+{
+	Frame *f;
+	Glyph *d;
+	const Glyph *g;
+	int64_t n;
+	int i, y, x0, x1, full;
+
+	for (;;) {
+		if ((i = atomic_load(&front)) < 0)
+			return 0;
+		atomic_fetch_add(&readers[i], 1);
+		if (!atomic_load(&writing[i]) && atomic_load(&front) == i)
+			break;
+		atomic_fetch_sub(&readers[i], 1);
+	}
+	f = &frames[i];
+	if (f->gen == dst->gen) {
+		atomic_fetch_sub(&readers[i], 1);
+		return 0;
+	}
+
+	if ((full = (dst->row != f->row || dst->col != f->col))) {
+		dst->row = f->row;
+		dst->col = f->col;
+		dst->line = xrealloc(dst->line,
+		                     dst->row * dst->col * sizeof(*dst->line));
+		dst->rowgen = xrealloc(dst->rowgen,
+		                       dst->row * sizeof(*dst->rowgen));
+		dst->damage = xrealloc(dst->damage,
+		                       dst->row * sizeof(*dst->damage));
+		dst->sel = xrealloc(dst->sel, dst->row * sizeof(*dst->sel));
+		dst->selgen = 0;
+	}
+	/* move what dst has with the rows scrolled since, the rest is copied */
+	n = f->scrolls - dst->scrolls;
+	dst->scroll = 0;
+	if (!full && n != 0 && n > -f->row && n < f->row) {
+		rowshift(dst->line, f->row, f->col * sizeof(*dst->line), n, NULL);
+		rowshift(dst->rowgen, f->row, sizeof(*dst->rowgen), n,
+		         &(uint64_t){ 0 });
+		dst->scroll = n;
+	} else if (n != 0) {
+		full = 1;
+	}
+	dst->scrolls = f->scrolls;
+	for (y = 0; y < f->row; y++) {
+		dst->damage[y] = none;
+		if (!full && dst->rowgen[y] == f->rowgen[y])
+			continue;
+		dst->rowgen[y] = f->rowgen[y];
+		d = dst->line + y * f->col;
+		g = f->line + y * f->col;
+		x0 = 0;
+		x1 = f->col - 1;
+		if (!full) {
+			while (x0 <= x1 && GLYPHEQ(d[x0], g[x0]))
+				x0++;
+			while (x1 >= x0 && GLYPHEQ(d[x1], g[x1]))
+				x1--;
+			if (x0 > x1)
+				continue;
+		}
+		memcpy(d + x0, g + x0, (x1 - x0 + 1) * sizeof(Glyph));
+		dst->damage[y] = (Span){ x0, x1 };
+	}
+	if (dst->selgen != f->selgen) {
+		memcpy(dst->sel, f->sel, f->row * sizeof(*f->sel));
+		dst->selgen = f->selgen;
+	}
+	dst->stylelo = f->nstyles;
+	if (dst->stylegen != f->stylegen) {
+		if (dst->styles == NULL)
+			dst->styles = xmalloc(STYLE_MAX * sizeof(Style));
+		dst->stylelo = stylesince(f->stylelog, dst->stylegen);
+		memcpy(dst->styles + dst->stylelo, f->styles + dst->stylelo,
+		       (f->nstyles - dst->stylelo) * sizeof(Style));
+		dst->nstyles = f->nstyles;
+		dst->stylegen = f->stylegen;
+	}
+	dst->cx = f->cx;
+	dst->cy = f->cy;
+	dst->cursormode = f->cursormode;
+	dst->cursor = f->cursor;
+	dst->palettegen = f->palettegen;
+	dst->blinkoff = f->blinkoff;
+	dst->scr = f->scr;
+	dst->gen = f->gen;
+
+	atomic_fetch_sub(&readers[i], 1);
+	return 1;
+}
+
+void
+snapfree(Frame *f)
+{
+	free(f->line);
+	free(f->rowgen);
+	free(f->damage);
+	free(f->sel);
+	free(f->styles);
+	memset(f, 0, sizeof(*f));
+}
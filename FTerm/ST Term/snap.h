@@ -0,0 +1,50 @@
+//
+//  snap.h
+//  FTerm
+//
+//  Screen snapshots for readers on other threads, see snap.c
+//
+
+#ifndef snap_h
+#define snap_h
+
+#include <stdint.h>
+#include "st.h"
+#include "st_types.h"
+
+#define SNAP_STYLELOG	16	/* style changes a frame remembers */
+
+typedef struct {
+	uint64_t gen;       /* the publish that showed it */
+	int lo;             /* lowest style written */
+} StyleMark;
+
+typedef struct {
+	uint64_t gen;       /* publishes up to this frame, 0 for none */
+	int row, col;
+	Glyph *line;        /* row * col cells */
+	uint64_t *rowgen;   /* gen of the last change to each row */
+	Span *damage;       /* snapread(): columns changed since the last read */
+	int64_t scrolls;    /* rows scrolled up so far, down counts negative */
+	int scroll;         /* snapread(): rows line moved up by, then damage */
+	Span *sel;          /* selected columns of each row */
+	uint64_t selgen;    /* gen of the last change to sel */
+	int cx, cy;         /* cursor, as macos_drawcursor() left it */
+	int cursormode;
+	Glyph cursor;
+	Style *styles;      /* room for STYLE_MAX, nstyles in use */
+	int nstyles;
+	uint64_t stylegen;  /* gen of the last change to styles */
+	StyleMark stylelog[SNAP_STYLELOG]; /* the last changes to styles */
+	int stylelo;        /* snapread(): lowest style changed since */
+	uint64_t palettegen; /* changes when the palette needs a reload */
+	int blinkoff;       /* blinking text is hidden in this frame */
+	int scr;            /* history lines shown above the screen */
+} Frame;
+
+int snappublish(void);
+int snappending(void);
+int snapread(Frame *);
+void snapfree(Frame *);
+
+#endif /* snap_h */
@@ -17,7 +17,7 @@
 #include <unistd.h>
 #include <wchar.h>
 
-#include <pthread/pthread.h>
+#include <pthread.h>
 
 #include "st.h"
 #include "macos_support.h"
@@ -31,6 +31,14 @@
 #endif
 
 #include "st_types.h"
+#include "runewidth.h"
+#include "hist.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+ #include <immintrin.h>
+#elif defined(__ARM_NEON)
+ #include <arm_neon.h>
+#endif
 
 static void execsh(char *, char **);
 static void stty(char **);
@@ -39,10 +47,10 @@ static void ttywriteraw(const char *, size_t);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
+static void csiparse(int, uchar);
 static void csireset(void);
 static void osc_color_response(int, int, int);
-static int eschandle(uchar);
+static void eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
@@ -64,16 +72,24 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputascii(const char *, size_t);
+static size_t tputrun(const Rune *, size_t);
 static void treset(void);
 static void tscrollup(int, int);
 static void tscrolldown(int, int);
 static void tsetattr(const int *, int);
 static void tsetchar(Rune, const Glyph *, int, int);
 static void tsetdirt(int, int);
+static void tsetdirtx(int, int, int);
+static int tsetdirtdiff(int, int, int, const Glyph *, int);
 static void tsetscroll(int, int);
+static void tslide(int);
+static void tshiftdamage(int);
+static void tshiftlines(int, int);
 static void tswapscreen(void);
+static void tviewscroll(int);
 static void tsetmode(int, int, const int *, int);
-static int twrite(const char *, size_t, int);
+static void twriterune(Rune, int);
 static void tfulldirt(void);
 static void tcontrolcode(uchar );
 static void tdectest(char );
@@ -85,10 +101,16 @@ static void tstrsequence(uchar);
 static void drawregion(int, int, int, int);
 
 static void selnormalize(void);
+static void selspan(void);
 static void selscroll(int, int);
 static void selsnap(int *, int *, int);
 
+static size_t asciirun(const char *, size_t);
+static size_t floodrun(const char *, size_t);
+static int floodstep(const char *, size_t, int *, int *);
+static size_t tflood(const char *, size_t);
 static size_t utf8decode(const char *, Rune *, size_t);
+static size_t utf8decodebuf(const char *, size_t, Rune *, uchar *, size_t);
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
@@ -98,6 +120,12 @@ static char base64dec_getc(const char **);
 
 static ssize_t xwrite(int, const char *, size_t);
 
+static void stylegc(void);
+static ushort stylenear(uint32_t, uint32_t);
+static void stylenearscan(int, uint32_t, uint32_t, uint32_t *, int *);
+static void stylenearindex(void);
+static uint32_t colordist(uint32_t, uint32_t);
+
 /* Globals */
 Term term;
 
@@ -107,6 +135,149 @@ static STREscape strescseq;
 static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
+static void (*handoff)(const char *, size_t); /* see ttyhandoff() */
+static TCursor csaved[2];
+static const Span clean = { INT_MAX, -1 };
+static const LineInfo unknown = { 0, -1 };
+static int damagey;
+static uint64_t delimmap[0x10000 / 64]; /* worddelimiters in the BMP */
+
+/*
+ * Colors are interned, a cell only holds the index of its (fg, bg)
+ * pair. Unused pairs are swept when the table fills up, but at most
+ * once per STYLE_GCEVERY pairs asked for, since a sweep looks at every
+ * cell. A pair that finds no room in between gets the nearest one in
+ * the table, see stylenear().
+ */
+#define STYLEHASH(fg, bg) \
+	(((fg) * 0x9e3779b1u ^ (bg) * 0x85ebca77u) >> (32 - 17))
+#define STYLE_GCEVERY	4096	/* new pairs between two sweeps */
+#define NEAR_GRID	4096	/* 16 levels of red, green and blue */
+#define NEARKEY(c)	(IS_TRUECOL(c) ? \
+	((c) >> 12 & 0xf00) | ((c) >> 8 & 0xf0) | ((c) >> 4 & 0xf) : \
+	NEAR_GRID + ((c) & 0xff))
+
+Style styles[STYLE_MAX];
+int nstyles;
+int styleslo;    /* lowest style written since snappublish() looked */
+int blinkset;    /* SGR 5 or 6 was seen since the parser looked */
+int syncset;     /* mode 2026 was set since the parser looked */
+static uint32_t stylehash[2 * STYLE_MAX]; /* index + 1, 0 when empty */
+static ushort stylefree[STYLE_MAX];
+static int nstylefree;
+static int stylewant = STYLE_GCEVERY; /* new pairs since stylegc() */
+static ushort nearorder[STYLE_MAX];   /* styles by NEARKEY() of fg */
+static int nearstart[NEAR_GRID + 256 + 1]; /* where each key starts */
+static int nearbuilt;                 /* the two above are up to date */
+
+/*
+ * The escape parser is a table driven state machine in the spirit of
+ * Paul Williams' DEC VT parser. Every rune is mapped to a class, and
+ * esctrans[state][class] gives the action to run (low nibble) and the
+ * state to continue in (high nibble).
+ */
+enum escape_class {
+	CC_CTRL,     /* C0 controls other than the ones below, DEL */
+	CC_STREND,   /* BEL, CAN, SUB, ESC and C1: interrupt a string */
+	CC_INTER,    /* 0x20 - 0x2f not listed below */
+	CC_HASH,     /* # */
+	CC_PERCENT,  /* % */
+	CC_SCS,      /* ( ) * + */
+	CC_DIGIT,    /* 0 - 9 */
+	CC_SEMI,     /* ; */
+	CC_QUEST,    /* ? */
+	CC_PARAM,    /* : < = > */
+	CC_CSI,      /* [ */
+	CC_STRSEQ,   /* P ] ^ _ k */
+	CC_FINAL,    /* 0x40 - 0x7e not listed above */
+	CC_PRINT,    /* everything from 0xa0 on */
+	CC_LAST
+};
+
+enum escape_action {
+	A_NONE,
+	A_PRINT,
+	A_EXECUTE,
+	A_STR_START,
+	A_STR_PUT,
+	A_STR_END,
+	A_ESC_DISPATCH,
+	A_CHARSET_SELECT,
+	A_CHARSET,
+	A_TEST,
+	A_UTF8,
+	A_CSI_PRIV,
+	A_CSI_DIGIT,
+	A_CSI_SEP,
+	A_CSI_COLLECT,
+	A_CSI_DISPATCH,
+};
+
+static const uchar escclass[256] = {
+	[0x00 ... 0x06] = CC_CTRL,   ['\a']           = CC_STREND,
+	[0x08 ... 0x17] = CC_CTRL,   [030]            = CC_STREND,
+	[031]           = CC_CTRL,   [032 ... 033]    = CC_STREND,
+	[0x1c ... 0x1f] = CC_CTRL,
+	[' ' ... '"']   = CC_INTER,  ['#']            = CC_HASH,
+	['$']           = CC_INTER,  ['%']            = CC_PERCENT,
+	['&' ... '\''] = CC_INTER,  ['(' ... '+']    = CC_SCS,
+	[',' ... '/']   = CC_INTER,  ['0' ... '9']    = CC_DIGIT,
+	[':']           = CC_PARAM,  [';']            = CC_SEMI,
+	['<' ... '>']   = CC_PARAM,  ['?']            = CC_QUEST,
+	['@' ... 'O']   = CC_FINAL,  ['P']            = CC_STRSEQ,
+	['Q' ... 'Z']   = CC_FINAL,  ['[']            = CC_CSI,
+	['\\']          = CC_FINAL,  [']']            = CC_STRSEQ,
+	['^' ... '_']   = CC_STRSEQ, ['`' ... 'j']    = CC_FINAL,
+	['k']           = CC_STRSEQ, ['l' ... '~']    = CC_FINAL,
+	[0x7f]          = CC_CTRL,   [0x80 ... 0x9f]  = CC_STREND,
+	[0xa0 ... 0xff] = CC_PRINT,
+};
+
+#define T(s, a)		(ESC_##s << 4 | A_##a)
+#define ESCROW(s, a)	[CC_CTRL] = T(s, EXECUTE), [CC_STREND] = T(s, EXECUTE), \
+			[CC_INTER ... CC_PRINT] = T(GROUND, a)
+
+static const uchar esctrans[][CC_LAST] = {
+	[ESC_GROUND] = {
+		[CC_CTRL]               = T(GROUND, EXECUTE),
+		[CC_STREND]             = T(GROUND, EXECUTE),
+		[CC_INTER ... CC_PRINT] = T(GROUND, PRINT),
+	},
+	[ESC_START] = {
+		[CC_CTRL]               = T(START, EXECUTE),
+		[CC_STREND]             = T(START, EXECUTE),
+		[CC_INTER]              = T(GROUND, ESC_DISPATCH),
+		[CC_HASH]               = T(TEST, NONE),
+		[CC_PERCENT]            = T(UTF8, NONE),
+		[CC_SCS]                = T(ALTCHARSET, CHARSET_SELECT),
+		[CC_DIGIT ... CC_PARAM] = T(GROUND, ESC_DISPATCH),
+		[CC_CSI]                = T(CSI, NONE),
+		[CC_STRSEQ]             = T(STR, STR_START),
+		[CC_FINAL ... CC_PRINT] = T(GROUND, ESC_DISPATCH),
+	},
+	[ESC_CSI] = {
+		[CC_CTRL]               = T(CSI, EXECUTE),
+		[CC_STREND]             = T(CSI, EXECUTE),
+		[CC_INTER ... CC_SCS]   = T(CSI, CSI_COLLECT),
+		[CC_DIGIT]              = T(CSI, CSI_DIGIT),
+		[CC_SEMI]               = T(CSI, CSI_SEP),
+		[CC_QUEST]              = T(CSI, CSI_PRIV),
+		[CC_PARAM]              = T(CSI, CSI_COLLECT),
+		[CC_CSI ... CC_FINAL]   = T(GROUND, CSI_DISPATCH),
+		[CC_PRINT]              = T(CSI, CSI_COLLECT),
+	},
+	[ESC_STR] = {
+		[CC_CTRL]               = T(STR, STR_PUT),
+		[CC_STREND]             = T(GROUND, STR_END),
+		[CC_INTER ... CC_PRINT] = T(STR, STR_PUT),
+	},
+	[ESC_ALTCHARSET] = { ESCROW(ALTCHARSET, CHARSET) },
+	[ESC_TEST]       = { ESCROW(TEST, TEST) },
+	[ESC_UTF8]       = { ESCROW(UTF8, UTF8) },
+};
+
+#undef ESCROW
+#undef T
 
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -161,6 +332,60 @@ xstrdup(const char *s)
 	return p;
 }
 
+/*
+ * returns the length of the leading run of printable ASCII (0x20 - 0x7e)
+ * in c, scanning 16 or 32 bytes at a time where the target allows it
+ */
+size_t
+asciirun(const char *c, size_t clen)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+
+	for (; i + 32 <= clen; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(c + i));
+		uint32_t m = _mm256_movemask_epi8(_mm256_and_si256(
+		                 _mm256_cmpgt_epi8(v, lo),
+		                 _mm256_cmpgt_epi8(hi, v)));
+		if (m != 0xFFFFFFFF)
+			return i + __builtin_ctz(~m);
+	}
+#elif defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+
+	for (; i + 16 <= clen; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(c + i));
+		uint32_t m = _mm_movemask_epi8(_mm_and_si128(
+		                 _mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+		if (m != 0xFFFF)
+			return i + __builtin_ctz(~m);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t lo = vdupq_n_u8(0x1f), hi = vdupq_n_u8(0x7f);
+
+	for (; i + 16 <= clen; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(c + i));
+		uint8x16_t m = vandq_u8(vcgtq_u8(v, lo), vcltq_u8(v, hi));
+		uint64_t bits;
+
+		if (vminvq_u8(m) == 0xFF)
+			continue;
+		/* 4 bits per byte, so the first clear nibble is the end */
+		bits = vget_lane_u64(vreinterpret_u64_u8(
+		           vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		return i + (__builtin_ctzll(~bits) >> 2);
+	}
+#endif
+	for (; i < clen; i++) {
+		if (!BETWEEN(c[i], 0x20, 0x7e))
+			break;
+	}
+
+	return i;
+}
+
 size_t
 utf8decode(const char *c, Rune *u, size_t clen)
 {
@@ -186,6 +411,108 @@ utf8decode(const char *c, Rune *u, size_t clen)
 	return len;
 }
 
+/*
+ * Decodes the run of multibyte sequences at the start of c into u, storing
+ * the length of every sequence in ulen, and stops at the first ASCII byte,
+ * at an incomplete trailing sequence or when usiz runes were produced.
+ * Results are the same as calling utf8decode() for every sequence, but
+ * blocks of well formed 2 or 3 byte sequences, the bulk of CJK, box
+ * drawing and most non-latin text, are validated 16 bytes at a time.
+ * Returns the number of runes decoded.
+ */
+size_t
+utf8decodebuf(const char *c, size_t clen, Rune *u, uchar *ulen, size_t usiz)
+{
+	static const uchar m2[16] = {
+		0xE0, 0xC0, 0xE0, 0xC0, 0xE0, 0xC0, 0xE0, 0xC0,
+		0xE0, 0xC0, 0xE0, 0xC0, 0xE0, 0xC0, 0xE0, 0xC0,
+	};
+	static const uchar v2[16] = {
+		0xC0, 0x80, 0xC0, 0x80, 0xC0, 0x80, 0xC0, 0x80,
+		0xC0, 0x80, 0xC0, 0x80, 0xC0, 0x80, 0xC0, 0x80,
+	};
+	static const uchar m3[16] = {
+		0xF0, 0xC0, 0xC0, 0xF0, 0xC0, 0xC0, 0xF0, 0xC0,
+		0xC0, 0xF0, 0xC0, 0xC0, 0xF0, 0xC0, 0xC0, 0x00,
+	};
+	static const uchar v3[16] = {
+		0xE0, 0x80, 0x80, 0xE0, 0x80, 0x80, 0xE0, 0x80,
+		0x80, 0xE0, 0x80, 0x80, 0xE0, 0x80, 0x80, 0x00,
+	};
+	const uchar *p;
+	size_t i, j, n, len;
+	int blk;
+
+	for (i = 0, n = 0; i < clen && n < usiz && (c[i] & 0x80); ) {
+		p = (const uchar *)c + i;
+		blk = 0;
+		if (clen - i >= 16 && usiz - n >= 8) {
+#if defined(__SSE2__)
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v,
+			    _mm_loadu_si128((const __m128i *)m3)),
+			    _mm_loadu_si128((const __m128i *)v3))) == 0xFFFF)
+				blk = 3;
+			else if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v,
+			    _mm_loadu_si128((const __m128i *)m2)),
+			    _mm_loadu_si128((const __m128i *)v2))) == 0xFFFF)
+				blk = 2;
+#elif defined(__ARM_NEON)
+			uint8x16_t v = vld1q_u8(p);
+
+			if (vminvq_u8(vceqq_u8(vandq_u8(v, vld1q_u8(m3)),
+			    vld1q_u8(v3))) == 0xFF)
+				blk = 3;
+			else if (vminvq_u8(vceqq_u8(vandq_u8(v, vld1q_u8(m2)),
+			    vld1q_u8(v2))) == 0xFF)
+				blk = 2;
+#else
+			for (j = 0; j < 16 && (p[j] & m3[j]) == v3[j]; j++)
+				;
+			if (j == 16) {
+				blk = 3;
+			} else {
+				for (j = 0; j < 16 && (p[j] & m2[j]) == v2[j]; j++)
+					;
+				if (j == 16)
+					blk = 2;
+			}
+#endif
+		}
+
+		switch (blk) {
+		case 3: /* five 3 byte sequences */
+			for (j = 0; j < 15; j += 3, n++) {
+				u[n] = (p[j] & 0x0F) << 12 | (p[j+1] & 0x3F) << 6 |
+				       (p[j+2] & 0x3F);
+				if (u[n] < 0x800 || BETWEEN(u[n], 0xD800, 0xDFFF))
+					u[n] = UTF_INVALID;
+				ulen[n] = 3;
+			}
+			i += 15;
+			break;
+		case 2: /* eight 2 byte sequences */
+			for (j = 0; j < 16; j += 2, n++) {
+				u[n] = (p[j] & 0x1F) << 6 | (p[j+1] & 0x3F);
+				if (u[n] < 0x80)
+					u[n] = UTF_INVALID;
+				ulen[n] = 2;
+			}
+			i += 16;
+			break;
+		default:
+			if ((len = utf8decode(c + i, &u[n], clen - i)) == 0)
+				return n;
+			ulen[n++] = len;
+			i += len;
+			break;
+		}
+	}
+
+	return n;
+}
+
 Rune
 utf8decodebyte(char c, size_t *i)
 {
@@ -280,23 +607,37 @@ base64dec(const char *src)
 void
 selinit(void)
 {
+	const wchar_t *d;
+
 	sel.mode = SEL_IDLE;
 	sel.snap = 0;
 	sel.ob.x = -1;
+
+	memset(delimmap, 0, sizeof(delimmap));
+	for (d = worddelimiters; *d; d++) {
+		if (*d < 0x10000)
+			delimmap[*d >> 6] |= 1ULL << (*d & 63);
+	}
 }
 
 int
 tlinelen(int y)
 {
+	const Glyph *line = TLINE(y);
 	int i = term.col;
 
-	if (term.line[y][i - 1].mode & ATTR_WRAP)
-		return i;
+	/* kept until the line is written to, not for history lines */
+	if (y >= term.scr && term.info[y - term.scr].len >= 0)
+		return term.info[y - term.scr].len;
 
-	while (i > 0 && term.line[y][i - 1].u == ' ')
-		--i;
+	if (!(line[i - 1].mode & ATTR_WRAP)) {
+		while (i > 0 && line[i - 1].u == ' ')
+			--i;
+	}
 
-	return i;
+	if (y < term.scr)
+		return i;
+	return term.info[y - term.scr].len = i;
 }
 
 void
@@ -310,6 +651,7 @@ selstart(int col, int row, int snap)
 	sel.oe.x = sel.ob.x = col;
 	sel.oe.y = sel.ob.y = row;
 	selnormalize();
+	selspan();
 
 	if (sel.snap != 0)
 		sel.mode = SEL_READY;
@@ -338,6 +680,7 @@ selextend(int col, int row, int type, int done)
 	sel.oe.y = row;
 	selnormalize();
 	sel.type = type;
+	selspan();
 
 	if (oldey != sel.oe.y || oldex != sel.oe.x || oldtype != sel.type || sel.mode == SEL_EMPTY)
 		tsetdirt(MIN(sel.nb.y, oldsby), MAX(sel.ne.y, oldsey));
@@ -373,20 +716,83 @@ selnormalize(void)
 		sel.ne.x = term.col - 1;
 }
 
+/*
+ * caches the columns selected on each line, it has to be called whenever
+ * the normalized selection or its type changes
+ */
+void
+selspan(void)
+{
+	int y;
+
+	for (y = 0; y < term.row; y++) {
+		if (!BETWEEN(y, sel.nb.y, sel.ne.y))
+			sel.span[y] = clean;
+		else if (sel.type == SEL_RECTANGULAR)
+			sel.span[y] = (Span){ sel.nb.x, sel.ne.x };
+		else
+			sel.span[y] = (Span){ (y == sel.nb.y) ? sel.nb.x : 0,
+			                      (y == sel.ne.y) ? sel.ne.x : term.col-1 };
+	}
+}
+
 int
 selected(int x, int y)
 {
+	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
+			sel.alt != IS_SET(MODE_ALTSCREEN) ||
+			!BETWEEN(y, 0, term.row-1))
+		return 0;
+
+	return BETWEEN(x, sel.span[y].x0, sel.span[y].x1);
+}
+
+/* the columns selected on line y, returns 0 when there are none */
+int
+selcols(int y, int *x0, int *x1)
+{
+	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
+			sel.alt != IS_SET(MODE_ALTSCREEN) ||
+			!BETWEEN(y, 0, term.row-1) ||
+			sel.span[y].x0 > sel.span[y].x1)
+		return 0;
+
+	*x0 = sel.span[y].x0;
+	*x1 = sel.span[y].x1;
+	return 1;
+}
+
+/*
+ * returns whether any cell from x1,y1 to x2,y2 is selected, the same as
+ * testing selected() on each of them
+ */
+int
+selintersect(int x1, int y1, int x2, int y2)
+{
+	int y, lo, hi;
+
 	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
 			sel.alt != IS_SET(MODE_ALTSCREEN))
 		return 0;
 
+	y1 = MAX(y1, sel.nb.y);
+	y2 = MIN(y2, sel.ne.y);
+	if (y1 > y2)
+		return 0;
 	if (sel.type == SEL_RECTANGULAR)
-		return BETWEEN(y, sel.nb.y, sel.ne.y)
-		    && BETWEEN(x, sel.nb.x, sel.ne.x);
+		return x1 <= sel.ne.x && x2 >= sel.nb.x;
 
-	return BETWEEN(y, sel.nb.y, sel.ne.y)
-	    && (y != sel.nb.y || x >= sel.nb.x)
-	    && (y != sel.ne.y || x <= sel.ne.x);
+	/* only the first and the last selected lines are partial */
+	if (y2 - y1 >= 2)
+		return 1;
+	for (y = y1; y <= y2; y++) {
+		lo = (y == sel.nb.y) ? sel.nb.x : 0;
+		hi = (y == sel.ne.y) ? sel.ne.x : term.col-1;
+		if (x1 <= hi && x2 >= lo)
+			return 1;
+	}
+
+	return 0;
 }
 
 void
@@ -402,7 +808,7 @@ selsnap(int *x, int *y, int direction)
 		 * Snap around if the word wraps around at the end or
 		 * beginning of a line.
 		 */
-		prevgp = &term.line[*y][*x];
+		prevgp = &TLINE(*y)[*x];
 		prevdelim = ISDELIM(prevgp->u);
 		for (;;) {
 			newx = *x + direction;
@@ -424,14 +830,14 @@ selsnap(int *x, int *y, int direction)
                     xt = newx;
                 }
                 
-				if (!(term.line[yt][xt].mode & ATTR_WRAP))
+				if (!(TLINE(yt)[xt].mode & ATTR_WRAP))
 					break;
 			}
 
 			if (newx >= tlinelen(newy))
 				break;
 
-			gp = &term.line[newy][newx];
+			gp = &TLINE(newy)[newx];
 			delim = ISDELIM(gp->u);
 			if (!(gp->mode & ATTR_WDUMMY) && (delim != prevdelim
 					|| (delim && gp->u != prevgp->u)))
@@ -452,14 +858,14 @@ selsnap(int *x, int *y, int direction)
 		*x = (direction < 0) ? 0 : term.col - 1;
 		if (direction < 0) {
 			for (; *y > 0; *y += direction) {
-				if (!(term.line[*y-1][term.col-1].mode
+				if (!(TLINE(*y-1)[term.col-1].mode
 						& ATTR_WRAP)) {
 					break;
 				}
 			}
 		} else if (direction > 0) {
 			for (; *y < term.row-1; *y += direction) {
-				if (!(term.line[*y][term.col-1].mode
+				if (!(TLINE(*y)[term.col-1].mode
 						& ATTR_WRAP)) {
 					break;
 				}
@@ -469,34 +875,44 @@ selsnap(int *x, int *y, int direction)
 	}
 }
 
-char *
-getsel(void)
+/*
+ * Streams the selected text to fn as UTF-8 in chunks of at most BUFSIZ
+ * bytes, so a copy of any size only needs one chunk of memory. fn returns
+ * nonzero to cancel and selstream() returns that value, 0 once all of the
+ * selection was passed and -1 if there is none.
+ */
+int
+selstream(int (*fn)(const char *, size_t, void *), void *arg)
 {
-	char *str, *ptr;
-	int y, bufsize, lastx, linelen;
-	const Glyph *gp, *last;
+	char buf[BUFSIZ];
+	size_t n = 0;
+	int y, r, lastx, linelen;
+	const Glyph *line, *gp, *last;
 
 	if (sel.ob.x == -1)
-		return NULL;
-
-	bufsize = (term.col+1) * (sel.ne.y-sel.nb.y+1) * UTF_SIZ;
-	ptr = str = xmalloc(bufsize);
+		return -1;
 
 	/* append every set & selected glyph to the selection */
 	for (y = sel.nb.y; y <= sel.ne.y; y++) {
+		if (n > sizeof(buf) - UTF_SIZ) {
+			if ((r = fn(buf, n, arg)) != 0)
+				return r;
+			n = 0;
+		}
 		if ((linelen = tlinelen(y)) == 0) {
-			*ptr++ = '\n';
+			buf[n++] = '\n';
 			continue;
 		}
 
+		line = TLINE(y);
 		if (sel.type == SEL_RECTANGULAR) {
-			gp = &term.line[y][sel.nb.x];
+			gp = &line[sel.nb.x];
 			lastx = sel.ne.x;
 		} else {
-			gp = &term.line[y][sel.nb.y == y ? sel.nb.x : 0];
+			gp = &line[sel.nb.y == y ? sel.nb.x : 0];
 			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
 		}
-		last = &term.line[y][MIN(lastx, linelen-1)];
+		last = &line[MIN(lastx, linelen-1)];
 		while (last >= gp && last->u == ' ')
 			--last;
 
@@ -504,7 +920,12 @@ getsel(void)
 			if (gp->mode & ATTR_WDUMMY)
 				continue;
 
-			ptr += utf8encode(gp->u, ptr);
+			if (n > sizeof(buf) - UTF_SIZ) {
+				if ((r = fn(buf, n, arg)) != 0)
+					return r;
+				n = 0;
+			}
+			n += utf8encode(gp->u, buf + n);
 		}
 
 		/*
@@ -517,11 +938,54 @@ getsel(void)
 		 * FIXME: Fix the computer world.
 		 */
 		if ((y < sel.ne.y || lastx >= linelen) &&
-		    (!(last->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
-			*ptr++ = '\n';
+		    (sel.type == SEL_RECTANGULAR || last < line ||
+		     !(last->mode & ATTR_WRAP))) {
+			if (n > sizeof(buf) - UTF_SIZ) {
+				if ((r = fn(buf, n, arg)) != 0)
+					return r;
+				n = 0;
+			}
+			buf[n++] = '\n';
+		}
 	}
-	*ptr = 0;
-	return str;
+
+	return n > 0 ? fn(buf, n, arg) : 0;
+}
+
+typedef struct {
+	char *s;
+	size_t len;
+	size_t siz;
+} SelBuf;
+
+static int
+selappend(const char *s, size_t n, void *arg)
+{
+	SelBuf *b = arg;
+
+	if (b->len + n + 1 > b->siz) {
+		b->siz = MAX(2 * b->siz, b->len + n + 1);
+		b->s = xrealloc(b->s, b->siz);
+	}
+	memcpy(b->s + b->len, s, n);
+	b->len += n;
+
+	return 0;
+}
+
+/* the whole selection as one string, grown as selstream() produces it */
+char *
+getsel(void)
+{
+	SelBuf b = { NULL, 0, 0 };
+
+	if (selstream(selappend, &b) < 0)
+		return NULL;
+	if (b.s == NULL)
+		b.s = xmalloc(1);
+	b.s[b.len] = '\0';
+
+	return b.s;
 }
 
 void
@@ -699,6 +1163,16 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 	return cmdfd;
 }
 
+/*
+ * From now on another thread reads and writes cmdfd, see pipeline.c.
+ * Whatever ttywrite() would write goes to queue instead.
+ */
+void
+ttyhandoff(void (*queue)(const char *, size_t))
+{
+	handoff = queue;
+}
+
 size_t
 ttyread(void)
 {
@@ -760,6 +1234,11 @@ ttywriteraw(const char *s, size_t n)
 	ssize_t r;
 	size_t lim = 256;
 
+	if (handoff) {
+		handoff(s, n);
+		return;
+	}
+
 	/*
 	 * Remember that we are using a pty, which might be a modem line.
 	 * Writing too much will clog the line. That's why we are doing this
@@ -837,7 +1316,7 @@ tattrset(int attr)
 
 	for (i = 0; i < term.row-1; i++) {
 		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
+			if (TLINE(i)[j].mode & attr)
 				return 1;
 		}
 	}
@@ -854,7 +1333,141 @@ tsetdirt(int top, int bot)
 	LIMIT(bot, 0, term.row-1);
 
 	for (i = top; i <= bot; i++)
-		term.dirty[i] = 1;
+		term.dirty[i] = (Span){ 0, term.col-1 };
+}
+
+/* mark columns x0 to x1 of line y changed */
+void
+tsetdirtx(int y, int x0, int x1)
+{
+	Span *s = &term.dirty[y];
+
+	term.info[y] = unknown;
+	if (x0 < s->x0)
+		s->x0 = MAX(x0, 0);
+	if (x1 > s->x1)
+		s->x1 = MIN(x1, term.col-1);
+}
+
+/*
+ * returns the index of the first of n cells of a that differs from b,
+ * or n. b is a row of cells if bstep is 1 and a single cell if it is 0.
+ * Cells are 8 bytes and compared 2 or 4 at a time where the target allows.
+ */
+static int
+cellfirst(const Glyph *a, const Glyph *b, int bstep, int n)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	int64_t g;
+	__m256i vg;
+
+	memcpy(&g, b, sizeof(g));
+	vg = _mm256_set1_epi64x(g);
+	for (; i + 4 <= n; i += 4) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = bstep ?
+		    _mm256_loadu_si256((const __m256i *)(b + i)) : vg;
+		uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (m != 0xFFFFFFFF)
+			return i + __builtin_ctz(~m) / sizeof(Glyph);
+	}
+#elif defined(__SSE2__)
+	int64_t g;
+	__m128i vg;
+
+	memcpy(&g, b, sizeof(g));
+	vg = _mm_set1_epi64x(g);
+	for (; i + 2 <= n; i += 2) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = bstep ?
+		    _mm_loadu_si128((const __m128i *)(b + i)) : vg;
+		uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (m != 0xFFFF)
+			return i + __builtin_ctz(~m) / sizeof(Glyph);
+	}
+#elif defined(__ARM_NEON)
+	uint64x2_t vg = vld1q_dup_u64((const uint64_t *)b);
+
+	for (; i + 2 <= n; i += 2) {
+		uint64x2_t va = vld1q_u64((const uint64_t *)(a + i));
+		uint64x2_t vb = bstep ? vld1q_u64((const uint64_t *)(b + i)) : vg;
+		uint64x2_t m = vceqq_u64(va, vb);
+		if (vminvq_u32(vreinterpretq_u32_u64(m)) != 0xFFFFFFFF)
+			return i + (vgetq_lane_u64(m, 0) != 0);
+	}
+#endif
+	for (; i < n; i++) {
+		if (!GLYPHEQ(a[i], b[bstep * i]))
+			break;
+	}
+
+	return i;
+}
+
+/* sets n cells from gp on to g, 2 or 4 at a time where the target allows */
+static void
+cellfill(Glyph *gp, Glyph g, int n)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	int64_t v;
+	__m256i vg;
+
+	memcpy(&v, &g, sizeof(v));
+	vg = _mm256_set1_epi64x(v);
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_si256((__m256i *)(gp + i), vg);
+#elif defined(__SSE2__)
+	int64_t v;
+	__m128i vg;
+
+	memcpy(&v, &g, sizeof(v));
+	vg = _mm_set1_epi64x(v);
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_si128((__m128i *)(gp + i), vg);
+#elif defined(__ARM_NEON)
+	uint64x2_t vg = vld1q_dup_u64((const uint64_t *)&g);
+
+	for (; i + 2 <= n; i += 2)
+		vst1q_u64((uint64_t *)(gp + i), vg);
+#endif
+	for (; i < n; i++)
+		gp[i] = g;
+}
+
+/*
+ * mark the columns x to x+n-1 of line y that differ from the cells in g,
+ * before they are overwritten with them, see cellfirst() for gstep.
+ * Returns 0 if there is no difference.
+ */
+int
+tsetdirtdiff(int y, int x, int n, const Glyph *g, int gstep)
+{
+	const Glyph *line = &term.line[y][x];
+	int lo, hi;
+
+	if (n <= 0 || (lo = cellfirst(line, g, gstep, n)) == n)
+		return 0;
+	for (hi = n-1; GLYPHEQ(line[hi], g[gstep * hi]); hi--)
+		;
+	tsetdirtx(y, x + lo, x + hi);
+
+	return 1;
+}
+
+/* the cell clears fill with, it keeps the colors of the cursor */
+static Glyph
+tblank(void)
+{
+	Glyph g = term.c.attr;
+
+	g.mode = 0;
+	g.u = ' ';
+
+	return g;
 }
 
 void
@@ -864,7 +1477,7 @@ tsetdirtattr(int attr)
 
 	for (i = 0; i < term.row-1; i++) {
 		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
+			if (TLINE(i)[j].mode & attr) {
 				tsetdirt(i, i);
 				break;
 			}
@@ -881,14 +1494,13 @@ tfulldirt(void)
 void
 tcursor(int mode)
 {
-	static TCursor c[2];
 	int alt = IS_SET(MODE_ALTSCREEN);
 
 	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
+		csaved[alt] = term.c;
 	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+		term.c = csaved[alt];
+		tmoveto(csaved[alt].x, csaved[alt].y);
 	}
 }
 
@@ -899,8 +1511,7 @@ treset(void)
 
 	term.c = (TCursor){{
 		.mode = ATTR_NULL,
-		.fg = defaultfg,
-		.bg = defaultbg
+		.style = styleid(defaultfg, defaultbg)
 	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
 	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
@@ -923,7 +1534,8 @@ treset(void)
 void
 tnew(int col, int row)
 {
-	term = (Term){ .c = { .attr = { .fg = defaultfg, .bg = defaultbg } } };
+	/* the default colors are style 0, what zeroed cells get */
+	term = (Term){ .c = { .attr = { .style = styleid(defaultfg, defaultbg) } } };
 	tresize(col, row);
 	treset();
 }
@@ -932,30 +1544,136 @@ void
 tswapscreen(void)
 {
 	Line *tmp = term.line;
+	int i;
 
 	term.line = term.alt;
 	term.alt = tmp;
+	tmp = term.linebuf;
+	term.linebuf = term.altbuf;
+	term.altbuf = tmp;
 	term.mode ^= MODE_ALTSCREEN;
+	for (i = 0; i < term.row; i++)
+		term.info[i] = unknown;
 	tfulldirt();
 }
 
+/*
+ * The screen, the dirty spans and the line infos are windows of term.row
+ * entries into buffers of LINEBUF_SIZ(term.row) entries. Scrolling the
+ * whole screen slides the windows by n instead of rotating every line
+ * pointer, so only the n lines entering the screen are touched. A window
+ * is moved back to the middle of its buffer when it runs out of room.
+ */
 void
-tscrolldown(int orig, int n)
+tslide(int n)
 {
-	int i;
+	int i, y, room;
+	Glyph blank;
+
+	room = (LINEBUF_SIZ(term.row) - term.row) / 2;
+	if (term.line + n < term.linebuf ||
+	    term.line + n + term.row > term.linebuf + LINEBUF_SIZ(term.row)) {
+		memmove(term.linebuf + room, term.line,
+		        term.row * sizeof(Line));
+		term.line = term.linebuf + room;
+	}
+	if (term.dirty + n < term.dirtybuf ||
+	    term.dirty + n + term.row > term.dirtybuf + LINEBUF_SIZ(term.row)) {
+		memmove(term.dirtybuf + room, term.dirty,
+		        term.row * sizeof(*term.dirty));
+		term.dirty = term.dirtybuf + room;
+	}
+	if (term.info + n < term.infobuf ||
+	    term.info + n + term.row > term.infobuf + LINEBUF_SIZ(term.row)) {
+		memmove(term.infobuf + room, term.info,
+		        term.row * sizeof(*term.info));
+		term.info = term.infobuf + room;
+	}
+
+	/* the lines leaving one edge are reused at the other */
+	if (n > 0) {
+		for (i = 0; i < n; i++)
+			term.line[term.row + i] = term.line[i];
+		y = term.row - n;
+	} else {
+		for (i = -1; i >= n; i--)
+			term.line[i] = term.line[term.row + i];
+		y = 0;
+	}
+	term.line += n;
+	term.dirty += n;
+	term.info += n;
+	term.scrolled += n;
+
+	/* no selected() check, selscroll() drops what scrolls away */
+	blank = tblank();
+	for (i = 0; i < abs(n); i++, y++) {
+		term.dirty[y] = (Span){ 0, term.col-1 };
+		term.info[y] = (LineInfo){ blank.style + 1, 0 };
+		cellfill(term.line[y], blank, term.col);
+	}
+}
+
+/*
+ * Moves the lines from orig to term.bot up by n, or down by -n, and blanks
+ * the lines coming in. Before the lines are swapped every row is compared
+ * with what it is about to show, so a region that scrolls over identical
+ * content, blank lines in particular, is not marked dirty.
+ */
+void
+tshiftlines(int orig, int n)
+{
+	int i, lo, hi;
+	Glyph blank;
 	Line temp;
 
-	LIMIT(n, 0, term.bot-orig+1);
+	blank = tblank();
+	for (i = orig; i <= term.bot; i++) {
+		if (BETWEEN(i+n, orig, term.bot))
+			tsetdirtdiff(i, 0, term.col, term.line[i+n], 1);
+		else
+			tsetdirtdiff(i, 0, term.col, &blank, 0);
+	}
 
-	tsetdirt(orig, term.bot-n);
-	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+	/* the lines leaving one end come back blank at the other */
+	lo = n > 0 ? orig : term.bot+n+1;
+	hi = n > 0 ? orig+n-1 : term.bot;
+	if (selintersect(0, lo, term.col-1, hi))
+		selclear();
+	for (i = lo; i <= hi; i++)
+		cellfill(term.line[i], blank, term.col);
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+	if (n > 0) {
+		for (i = orig; i <= term.bot-n; i++) {
+			temp = term.line[i];
+			term.line[i] = term.line[i+n];
+			term.line[i+n] = temp;
+		}
+	} else {
+		for (i = term.bot; i >= orig-n; i--) {
+			temp = term.line[i];
+			term.line[i] = term.line[i+n];
+			term.line[i+n] = temp;
+		}
 	}
+	for (i = orig; i <= term.bot; i++) {
+		if (!BETWEEN(i+n, orig, term.bot))
+			term.info[i] = (LineInfo){ blank.style + 1, 0 };
+	}
+}
 
+void
+tscrolldown(int orig, int n)
+{
+	LIMIT(n, 0, term.bot-orig+1);
+
+	if (orig == 0 && term.bot == term.row-1 && n < term.row) {
+		tslide(-n);
+		selscroll(orig, n);
+		return;
+	}
+
+	tshiftlines(orig, -n);
 	selscroll(orig, n);
 }
 
@@ -963,19 +1681,23 @@ void
 tscrollup(int orig, int n)
 {
 	int i;
-	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	/* lines leaving the top of the main screen go to the history */
+	if (orig == 0 && !IS_SET(MODE_ALTSCREEN)) {
+		for (i = 0; i < n; i++)
+			histpush(term.line[i], term.col);
+	}
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+	if (orig == 0 && term.bot == term.row-1 && n < term.row) {
+		tslide(n);
+		selscroll(orig, -n);
+		return;
 	}
 
+	tshiftlines(orig, n);
+
 	selscroll(orig, -n);
 }
 
@@ -995,8 +1717,73 @@ selscroll(int orig, int n)
 			selclear();
 		} else {
 			selnormalize();
+			selspan();
+		}
+	}
+}
+
+/*
+ * Shows n more lines of the history above the screen, or n fewer when n
+ * is negative. What stays in view moves as when the screen scrolls, so
+ * the backend moves its rows and only the lines coming in are copied
+ * out of the history. While any are shown the rows of term.dirty and
+ * of the selection are the rows in view, not those of term.line.
+ */
+void
+tviewscroll(int n)
+{
+	int y, k, lo, hi, old, scr;
+	Line tmp;
+
+	scr = IS_SET(MODE_ALTSCREEN) ? 0 : term.scr + n;
+	LIMIT(scr, 0, histlines());
+	if ((n = scr - term.scr) == 0)
+		return;
+
+	/* a selection moved out of view is dropped, else it moves along */
+	if (sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN) &&
+	    (!BETWEEN(sel.ob.y + n, 0, term.row-1) ||
+	     !BETWEEN(sel.oe.y + n, 0, term.row-1)))
+		selclear();
+
+	old = MIN(term.scr, term.row);
+	term.scr = scr;
+	k = MIN(abs(n), term.row);
+	term.scrolled -= n;
+
+	/* the history lines still in view move with the rest */
+	for (y = 0; k < term.row && y < k; y++) {
+		if (n > 0) {
+			tmp = term.view[term.row-1];
+			memmove(term.view + 1, term.view,
+			        (term.row-1) * sizeof(Line));
+			term.view[0] = tmp;
+		} else {
+			tmp = term.view[0];
+			memmove(term.view, term.view + 1,
+			        (term.row-1) * sizeof(Line));
+			term.view[term.row-1] = tmp;
 		}
 	}
+	lo = (n > 0) ? 0 : MAX(old - k, 0);
+	hi = (n > 0) ? k : MIN(scr, term.row);
+	for (y = lo; y < hi; y++)
+		histline(scr - 1 - y, term.view[y], term.col);
+
+	if (n > 0)
+		memmove(term.dirty + k, term.dirty,
+		        (term.row - k) * sizeof(*term.dirty));
+	else
+		memmove(term.dirty, term.dirty + k,
+		        (term.row - k) * sizeof(*term.dirty));
+	tsetdirt((n > 0) ? 0 : term.row - k, (n > 0) ? k - 1 : term.row-1);
+
+	if (sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN)) {
+		sel.ob.y += n;
+		sel.oe.y += n;
+		selnormalize();
+		selspan();
+	}
 }
 
 void
@@ -1012,35 +1799,57 @@ tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
+/*
+ * CSI parameters are accumulated as the bytes arrive instead of being
+ * parsed once the final byte is seen:
+ * ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]]
+ */
 void
-csiparse(void)
+csiparse(int action, uchar c)
 {
-	char *p = csiescseq.buf, *np;
-	long int v;
+	int *v;
 
-	csiescseq.narg = 0;
-	if (*p == '?') {
-		csiescseq.priv = 1;
-		p++;
-	}
+	csiescseq.buf[csiescseq.len++] = c;
+	/* anything after the first mode char is another mode char */
+	if (csiescseq.nmode && action != A_CSI_DISPATCH)
+		action = A_CSI_COLLECT;
 
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-//        csiescseq.arg[csiescseq.narg++] = (char)v;   this is wrong...
-		csiescseq.arg[csiescseq.narg++] = (int)v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
+	switch (action) {
+	case A_CSI_PRIV:
+		if (csiescseq.len == 1) {
+			csiescseq.priv = 1;
 			break;
-		p++;
+		}
+		/* FALLTHROUGH */
+	case A_CSI_COLLECT:
+	collect:
+		if (csiescseq.nmode < LEN(csiescseq.mode))
+			csiescseq.mode[csiescseq.nmode++] = c;
+		break;
+	case A_CSI_DIGIT:
+		v = &csiescseq.arg[csiescseq.narg];
+		if (*v < 0)
+			break;
+		*v = (*v > (INT_MAX - (c - '0')) / 10) ? -1 : *v * 10 + c - '0';
+		break;
+	case A_CSI_SEP:
+		if (csiescseq.narg + 1 == ESC_ARG_SIZ)
+			goto collect;
+		csiescseq.narg++;
+		break;
+	case A_CSI_DISPATCH:
+		if (csiescseq.nmode < LEN(csiescseq.mode))
+			csiescseq.mode[csiescseq.nmode++] = c;
+		goto dispatch;
 	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
+	if (csiescseq.len < sizeof(csiescseq.buf)-1)
+		return;
+
+dispatch:
+	term.esc = ESC_GROUND;
+	term.strend = 0;
+	csiescseq.narg++;
+	csihandle();
 }
 
 /* for absolute user moves, when decom is set */
@@ -1067,47 +1876,59 @@ tmoveto(int x, int y)
 	term.c.y = LIMIT(y, miny, maxy);
 }
 
+/*
+ * vt100 graphic charset for 0x41 - 0x7e, 0 leaves the char alone.
+ * The table is proudly stolen from rxvt.
+ */
+static const Rune vt100_0[62] = {
+	0x2191, 0x2193, 0x2192, 0x2190, 0x2588, 0x259a, 0x2603, /* A - G: ↑↓→←█▚☃ */
+	0, 0, 0, 0, 0, 0, 0, 0, /* H - O */
+	0, 0, 0, 0, 0, 0, 0, 0, /* P - W */
+	0, 0, 0, 0, 0, 0, 0, ' ', /* X - _ */
+	0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1, /* ` - g: ◆▒␉␌␍␊°± */
+	0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba, /* h - o: ␤␋┘┐┌└┼⎺ */
+	0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c, /* p - w: ⎻─⎼⎽├┤┴┬ */
+	0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7, /* x - ~: │≤≥π≠£· */
+};
+
+#define TRANSLATE(u)	(BETWEEN((u), 0x41, 0x7e) && vt100_0[(u) - 0x41] ? \
+			vt100_0[(u) - 0x41] : (u))
+
 void
 tsetchar(Rune u, const Glyph *attr, int x, int y)
 {
-	static const char *vt100_0[62] = { /* 0x41 - 0x7e */
-		"↑", "↓", "→", "←", "█", "▚", "☃", /* A - G */
-		0, 0, 0, 0, 0, 0, 0, 0, /* H - O */
-		0, 0, 0, 0, 0, 0, 0, 0, /* P - W */
-		0, 0, 0, 0, 0, 0, 0, " ", /* X - _ */
-		"◆", "▒", "␉", "␌", "␍", "␊", "°", "±", /* ` - g */
-		"␤", "␋", "┘", "┐", "┌", "└", "┼", "⎺", /* h - o */
-		"⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", /* p - w */
-		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
-	};
+	Glyph g, *line = term.line[y];
 
-	/*
-	 * The table is proudly stolen from rxvt.
-	 */
-	if (term.trantbl[term.charset] == CS_GRAPHIC0 &&
-	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
-		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
+	if (term.trantbl[term.charset] == CS_GRAPHIC0)
+		u = TRANSLATE(u);
+	g = *attr;
+	g.u = u;
+
+	/* repainting what is already there changes nothing */
+	if (GLYPHEQ(line[x], g))
+		return;
 
-	if (term.line[y][x].mode & ATTR_WIDE) {
+	if (line[x].mode & ATTR_WIDE) {
 		if (x+1 < term.col) {
-			term.line[y][x+1].u = ' ';
-			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
+			line[x+1].u = ' ';
+			line[x+1].mode &= ~ATTR_WDUMMY;
+			tsetdirtx(y, x+1, x+1);
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
-		term.line[y][x-1].u = ' ';
-		term.line[y][x-1].mode &= ~ATTR_WIDE;
+	} else if ((line[x].mode & ATTR_WDUMMY) && x > 0) {
+		line[x-1].u = ' ';
+		line[x-1].mode &= ~ATTR_WIDE;
+		tsetdirtx(y, x-1, x-1);
 	}
 
-	term.dirty[y] = 1;
-	term.line[y][x] = *attr;
-	term.line[y][x].u = u;
+	tsetdirtx(y, x, x);
+	line[x] = g;
 }
 
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	int y, temp, full;
+	Glyph blank;
 
 	if (x1 > x2)
     {
@@ -1128,17 +1949,18 @@ tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y1, 0, term.row-1);
 	LIMIT(y2, 0, term.row-1);
 
+	if (selintersect(x1, y1, x2, y2))
+		selclear();
+	blank = tblank();
+	full = x1 == 0 && x2 == term.col-1;
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if (selected(x, y))
-				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
-		}
+		/* lines cleared before with the same colors are skipped */
+		if (full && term.info[y].blank == blank.style + 1)
+			continue;
+		if (tsetdirtdiff(y, x1, x2-x1+1, &blank, 0))
+			cellfill(&term.line[y][x1], blank, x2-x1+1);
+		if (full)
+			term.info[y] = (LineInfo){ blank.style + 1, 0 };
 	}
 }
 
@@ -1155,6 +1977,7 @@ tdeletechar(int n)
 	size = term.col - src;
 	line = term.line[term.c.y];
 
+	tsetdirtdiff(term.c.y, dst, size, &line[src], 1);
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
 	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
 }
@@ -1172,6 +1995,7 @@ tinsertblank(int n)
 	size = term.col - dst;
 	line = term.line[term.c.y];
 
+	tsetdirtdiff(term.c.y, dst, size, &line[src], 1);
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
@@ -1245,6 +2069,8 @@ tsetattr(const int *attr, int l)
 {
 	int i;
 	int32_t idx;
+	uint32_t fg = styles[term.c.attr.style].fg;
+	uint32_t bg = styles[term.c.attr.style].bg;
 
 	for (i = 0; i < l; i++) {
 		switch (attr[i]) {
@@ -1258,8 +2084,8 @@ tsetattr(const int *attr, int l)
 				ATTR_REVERSE    |
 				ATTR_INVISIBLE  |
 				ATTR_STRUCK     );
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
+			fg = defaultfg;
+			bg = defaultbg;
 			break;
 		case 1:
 			term.c.attr.mode |= ATTR_BOLD;
@@ -1277,6 +2103,7 @@ tsetattr(const int *attr, int l)
 			/* FALLTHROUGH */
 		case 6: /* rapid blink */
 			term.c.attr.mode |= ATTR_BLINK;
+			blinkset = 1;
 			break;
 		case 7:
 			term.c.attr.mode |= ATTR_REVERSE;
@@ -1310,27 +2137,27 @@ tsetattr(const int *attr, int l)
 			break;
 		case 38:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = idx;
+				fg = idx;
 			break;
 		case 39:
-			term.c.attr.fg = defaultfg;
+			fg = defaultfg;
 			break;
 		case 48:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = idx;
+				bg = idx;
 			break;
 		case 49:
-			term.c.attr.bg = defaultbg;
+			bg = defaultbg;
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term.c.attr.fg = attr[i] - 30;
+				fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term.c.attr.bg = attr[i] - 40;
+				bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term.c.attr.fg = attr[i] - 90 + 8;
+				fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term.c.attr.bg = attr[i] - 100 + 8;
+				bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
@@ -1340,6 +2167,161 @@ tsetattr(const int *attr, int l)
 			break;
 		}
 	}
+	term.c.attr.style = styleid(fg, bg);
+}
+
+ushort
+styleid(uint32_t fg, uint32_t bg)
+{
+	uint32_t h, id;
+
+	for (h = STYLEHASH(fg, bg); (id = stylehash[h]) != 0;
+	     h = (h + 1) % LEN(stylehash)) {
+		if (styles[id-1].fg == fg && styles[id-1].bg == bg)
+			return id - 1;
+	}
+
+	if (stylewant < STYLE_GCEVERY)
+		stylewant++;
+	if (nstylefree == 0 && nstyles == STYLE_MAX) {
+		if (stylewant >= STYLE_GCEVERY)
+			stylegc();
+		/* every pair is in use, take the closest one */
+		if (nstylefree == 0)
+			return stylenear(fg, bg);
+		return styleid(fg, bg);
+	}
+	id = nstylefree ? stylefree[--nstylefree] : nstyles++;
+	styles[id] = (Style){ .fg = fg, .bg = bg };
+	styleslo = MIN(styleslo, id);
+	stylehash[h] = id + 1;
+	return id;
+}
+
+/* free the styles no cell refers to and rebuild the hash */
+void
+stylegc(void)
+{
+	static uchar used[STYLE_MAX];
+	uint32_t h;
+	int i, x, y;
+
+	memset(used, 0, sizeof(used));
+	used[0] = 1;
+	used[term.c.attr.style] = 1;
+	used[csaved[0].attr.style] = used[csaved[1].attr.style] = 1;
+	for (y = 0; y < term.row; y++) {
+		for (x = 0; x < term.col; x++) {
+			used[term.line[y][x].style] = 1;
+			used[term.alt[y][x].style] = 1;
+		}
+	}
+	histmark(used);
+
+	memset(stylehash, 0, sizeof(stylehash));
+	nearbuilt = 0;
+	stylewant = 0;
+	nstylefree = 0;
+	for (i = nstyles - 1; i >= 0; i--) {
+		if (!used[i]) {
+			stylefree[nstylefree++] = i;
+			continue;
+		}
+		for (h = STYLEHASH(styles[i].fg, styles[i].bg); stylehash[h];
+		     h = (h + 1) % LEN(stylehash))
+			;
+		stylehash[h] = i + 1;
+	}
+}
+
+/*
+ * A style in the full table whose colors look close to fg and bg, for
+ * a pair that did not fit. Rather than every style it looks at those
+ * whose foreground falls in the same cell of a 16 level color grid as
+ * fg, or the cells around it, and picks the closest of them.
+ */
+ushort
+stylenear(uint32_t fg, uint32_t bg)
+{
+	uint32_t best = UINT32_MAX;
+	int id = 0, r, x, y, z, cx, cy, cz;
+
+	/* nothing is added to a full table until stylegc() frees some */
+	if (!nearbuilt)
+		stylenearindex();
+
+	if (!IS_TRUECOL(fg)) {
+		stylenearscan(NEARKEY(fg), fg, bg, &best, &id);
+	} else {
+		cx = fg >> 20 & 0xf;
+		cy = fg >> 12 & 0xf;
+		cz = fg >> 4 & 0xf;
+		for (r = 0; r <= 1 && best == UINT32_MAX; r++) {
+			for (x = MAX(cx-r, 0); x <= MIN(cx+r, 15); x++)
+			for (y = MAX(cy-r, 0); y <= MIN(cy+r, 15); y++)
+			for (z = MAX(cz-r, 0); z <= MIN(cz+r, 15); z++)
+				stylenearscan(x << 8 | y << 4 | z, fg, bg,
+				              &best, &id);
+		}
+	}
+	/* nothing close by, look at all of them */
+	for (r = 0; best == UINT32_MAX && r < LEN(nearstart) - 1; r++)
+		stylenearscan(r, fg, bg, &best, &id);
+
+	return id;
+}
+
+/* the closest to fg and bg of the styles with NEARKEY() k so far */
+void
+stylenearscan(int k, uint32_t fg, uint32_t bg, uint32_t *best, int *id)
+{
+	uint32_t d;
+	int i;
+
+	for (i = nearstart[k]; i < nearstart[k+1]; i++) {
+		d = colordist(styles[nearorder[i]].fg, fg) +
+		    colordist(styles[nearorder[i]].bg, bg);
+		if (d < *best) {
+			*best = d;
+			*id = nearorder[i];
+		}
+	}
+}
+
+/* sorts the styles by NEARKEY() of their foreground */
+void
+stylenearindex(void)
+{
+	int i, k;
+
+	memset(nearstart, 0, sizeof(nearstart));
+	for (i = 0; i < nstyles; i++)
+		nearstart[NEARKEY(styles[i].fg) + 1]++;
+	for (k = 1; k < LEN(nearstart); k++)
+		nearstart[k] += nearstart[k-1];
+	for (i = 0; i < nstyles; i++)
+		nearorder[nearstart[NEARKEY(styles[i].fg)]++] = i;
+	/* each start moved on to the next one */
+	memmove(nearstart + 1, nearstart,
+	        (LEN(nearstart) - 1) * sizeof(*nearstart));
+	nearstart[0] = 0;
+	nearbuilt = 1;
+}
+
+/* squared distance of two truecolors, palette colors only match alike */
+uint32_t
+colordist(uint32_t a, uint32_t b)
+{
+	int dr, dg, db;
+
+	if (a == b)
+		return 0;
+	if (!IS_TRUECOL(a) || !IS_TRUECOL(b))
+		return 3 * 256 * 256;
+	dr = (int)(a >> 16 & 0xff) - (int)(b >> 16 & 0xff);
+	dg = (int)(a >> 8 & 0xff) - (int)(b >> 8 & 0xff);
+	db = (int)(a & 0xff) - (int)(b & 0xff);
+	return dr * dr + dg * dg + db * db;
 }
 
 void
@@ -1444,8 +2426,13 @@ tsetmode(int priv, int set, const int *args, int narg)
 				tcursor((set) ? CURSOR_SAVE : CURSOR_LOAD);
 				break;
 			case 2004: /* 2004: bracketed paste mode */
+				MODBIT(term.mode, set, MODE_PASTE);
 				macos_setmode(set, MODE_BRCKTPASTE);
 				break;
+			case 2026: /* synchronized update, see pipeline.c */
+				MODBIT(term.mode, set, MODE_SYNC);
+				syncset |= set;
+				break;
 			/* Not implemented mouse modes. See comments there. */
 			case 1001: /* mouse highlight mode; can hang the
 				      terminal by design when implemented. */
@@ -1604,6 +2591,9 @@ csihandle(void)
 		case 2: /* all */
 			tclearregion(0, 0, term.col-1, term.row-1);
 			break;
+		case 3: /* scrollback */
+			histclear();
+			break;
 		default:
 			goto unknown;
 		}
@@ -1773,7 +2763,7 @@ strhandle(void)
 		{ defaultcs, "cursor" }
 	};
 
-	term.esc &= ~(ESC_STR_END|ESC_STR);
+	term.strend = 0;
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1944,6 +2934,27 @@ toggleprinter(const Arg *arg)
 	term.mode ^= MODE_PRINT;
 }
 
+/* arg->i lines back into the history, a page less -arg->i when negative */
+void
+kscrollup(const Arg *arg)
+{
+	int n = arg->i;
+
+	if (n < 0)
+		n = MAX(term.row + n, 1);
+	tviewscroll(n);
+}
+
+void
+kscrolldown(const Arg *arg)
+{
+	int n = arg->i;
+
+	if (n < 0)
+		n = MAX(term.row + n, 1);
+	tviewscroll(-n);
+}
+
 void
 printscreen(const Arg *arg)
 {
@@ -1956,15 +2967,19 @@ printsel(const Arg *arg)
 	tdumpsel();
 }
 
+static int
+selprint(const char *s, size_t n, void *arg)
+{
+	tprinter((char *)s, n);
+
+	/* stop once the printer is gone */
+	return iofd == -1;
+}
+
 void
 tdumpsel(void)
 {
-	char *ptr;
-
-	if ((ptr = getsel())) {
-		tprinter(ptr, strlen(ptr));
-		free(ptr);
-	}
+	selstream(selprint, NULL);
 }
 
 void
@@ -2063,7 +3078,7 @@ tstrsequence(uchar c)
 	}
 	strreset();
 	strescseq.type = c;
-	term.esc |= ESC_STR;
+	term.esc = ESC_STR;
 }
 
 void
@@ -2086,7 +3101,7 @@ tcontrolcode(uchar ascii)
 		tnewline(IS_SET(MODE_CRLF));
 		return;
 	case '\a':   /* BEL */
-		if (term.esc & ESC_STR_END) {
+		if (term.strend) {
 			/* backwards compatibility to xterm */
 			strhandle();
 		} else {
@@ -2095,8 +3110,7 @@ tcontrolcode(uchar ascii)
 		break;
 	case '\033': /* ESC */
 		csireset();
-		term.esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-		term.esc |= ESC_START;
+		term.esc = ESC_START;
 		return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
@@ -2160,44 +3174,22 @@ tcontrolcode(uchar ascii)
 		return;
 	}
 	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term.esc &= ~(ESC_STR_END|ESC_STR);
+	term.strend = 0;
 }
 
 /*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
+ * final byte of a two char ESC sequence; the ones that open a longer
+ * sequence ([ # % ( ) * + and the string introducers) are dispatched
+ * by esctrans
  */
-int
+void
 eschandle(uchar ascii)
 {
 	switch (ascii) {
-	case '[':
-		term.esc |= ESC_CSI;
-		return 0;
-	case '#':
-		term.esc |= ESC_TEST;
-		return 0;
-	case '%':
-		term.esc |= ESC_UTF8;
-		return 0;
-	case 'P': /* DCS -- Device Control String */
-	case '_': /* APC -- Application Program Command */
-	case '^': /* PM -- Privacy Message */
-	case ']': /* OSC -- Operating System Command */
-	case 'k': /* old title set compatibility */
-		tstrsequence(ascii);
-		return 0;
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
 		term.charset = 2 + (ascii - 'n');
 		break;
-	case '(': /* GZD4 -- set primary charset G0 */
-	case ')': /* G1D4 -- set secondary charset G1 */
-	case '*': /* G2D4 -- set tertiary charset G2 */
-	case '+': /* G3D4 -- set quaternary charset G3 */
-		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
 	case 'D': /* IND -- Linefeed */
 		if (term.c.y == term.bot) {
 			tscrollup(term.top, 1);
@@ -2240,7 +3232,7 @@ eschandle(uchar ascii)
 		tcursor(CURSOR_LOAD);
 		break;
 	case '\\': /* ST -- String Terminator */
-		if (term.esc & ESC_STR_END)
+		if (term.strend)
 			strhandle();
 		break;
 	default:
@@ -2248,14 +3240,13 @@ eschandle(uchar ascii)
 			(uchar) ascii, isprint(ascii)? ascii:'.');
 		break;
 	}
-	return 1;
 }
 
 void
 tputc(Rune u)
 {
 	char c[UTF_SIZ];
-	int control;
+	int control, action;
     int width;
     size_t len;
 	Glyph *gp;
@@ -2267,27 +3258,49 @@ tputc(Rune u)
 		width = len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
-			width = 1;
+		if (!control)
+			width = runewidth(u);
 	}
 
 	if (IS_SET(MODE_PRINT))
 		tprinter(c, len);
 
-	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		   ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START|ESC_STR);
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
-		}
+	action = esctrans[term.esc][(u < LEN(escclass)) ? escclass[u] : CC_PRINT];
+	term.esc = action >> 4;
 
+	switch (action & 0xf) {
+	case A_NONE:
+		return;
+	case A_PRINT:
+		break;
+	case A_STR_END:
+		/*
+		 * A STR sequence uses all following characters until it
+		 * receives a ESC, a SUB, a ST or any other C1 control
+		 * character, which is then handled as usual.
+		 */
+		term.strend = 1;
+		/* FALLTHROUGH */
+	case A_EXECUTE:
+		/*
+		 * Actions of control codes must be performed as soon they
+		 * arrive because they can be embedded inside a control
+		 * sequence, and they must not cause conflicts with sequences.
+		 */
+		/* in UTF-8 mode ignore handling C1 control characters */
+		if (IS_SET(MODE_UTF8) && ISCONTROLC1(u))
+			return;
+		tcontrolcode(u);
+		/*
+		 * control codes are not shown ever
+		 */
+		if (term.esc == ESC_GROUND && !term.strend)
+			term.lastc = 0;
+		return;
+	case A_STR_START:
+		tstrsequence(u);
+		return;
+	case A_STR_PUT:
 		if (strescseq.len+len >= strescseq.siz) {
 			/*
 			 * Here is a bug in terminals. If the user never sends
@@ -2299,7 +3312,7 @@ tputc(Rune u)
 			 * In the case users ever get fixed, here is the code:
 			 */
 			/*
-			 * term.esc = 0;
+			 * term.esc = ESC_GROUND;
 			 * strhandle();
 			 */
 			if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
@@ -2311,67 +3324,57 @@ tputc(Rune u)
 		memmove(&strescseq.buf[strescseq.len], c, len);
 		strescseq.len += len;
 		return;
-	}
-
-check_control_code:
-	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
-	 */
-	if (control) {
-		/* in UTF-8 mode ignore handling C1 control characters */
-		if (IS_SET(MODE_UTF8) && ISCONTROLC1(u))
-			return;
-		tcontrolcode(u);
-		/*
-		 * control codes are not shown ever
-		 */
-		if (!term.esc)
-			term.lastc = 0;
+	case A_CHARSET_SELECT:
+		term.icharset = u - '(';
 		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
-		} else if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
-		} else {
-			if (!eschandle(u))
-				return;
-			/* sequence already finished */
-		}
-		term.esc = 0;
+	case A_CSI_PRIV:
+	case A_CSI_DIGIT:
+	case A_CSI_SEP:
+	case A_CSI_COLLECT:
+	case A_CSI_DISPATCH:
+		csiparse(action & 0xf, u);
+		return;
+	case A_ESC_DISPATCH:
+		eschandle(u);
+		goto finished;
+	case A_CHARSET:
+		tdeftran(u);
+		goto finished;
+	case A_TEST:
+		tdectest(u);
+		goto finished;
+	case A_UTF8:
+		tdefutf8(u);
+	finished:
 		/*
 		 * All characters which form part of a sequence are not
 		 * printed
 		 */
+		term.strend = 0;
 		return;
 	}
+
 	if (selected(term.c.x, term.c.y))
 		selclear();
 
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		if (!(gp->mode & ATTR_WRAP)) {
+			gp->mode |= ATTR_WRAP;
+			tsetdirtx(term.c.y, term.c.x, term.c.x);
+		}
 		tnewline(1);
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
 	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
+		tsetdirtdiff(term.c.y, term.c.x+width,
+		             term.col - term.c.x - width, gp, 1);
 		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
-		gp->mode &= ~ATTR_WIDE;
+		if (gp->mode & ATTR_WIDE) {
+			gp->mode &= ~ATTR_WIDE;
+			tsetdirtx(term.c.y, term.c.x, term.c.x);
+		}
 	}
 
 	if (term.c.x+width > term.col) {
@@ -2382,18 +3385,24 @@ check_control_code:
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
-	tsetchar(u, &term.c.attr, term.c.x, term.c.y);
 	term.lastc = u;
-
-	if (width == 2) {
-		gp->mode |= ATTR_WIDE;
-		if (term.c.x+1 < term.col) {
-			if (gp[1].mode == ATTR_WIDE && term.c.x+2 < term.col) {
-				gp[2].u = ' ';
-				gp[2].mode &= ~ATTR_WDUMMY;
+	if (width == 2 && gp[0].u == u && gp[0].style == term.c.attr.style &&
+	    gp[0].mode == (term.c.attr.mode | ATTR_WIDE) &&
+	    gp[1].u == '\0' && gp[1].mode == ATTR_WDUMMY) {
+		/* the same wide char is already there */
+	} else {
+		tsetchar(u, &term.c.attr, term.c.x, term.c.y);
+		if (width == 2) {
+			gp->mode |= ATTR_WIDE;
+			tsetdirtx(term.c.y, term.c.x, term.c.x+2);
+			if (term.c.x+1 < term.col) {
+				if ((gp[1].mode & ATTR_WIDE) && term.c.x+2 < term.col) {
+					gp[2].u = ' ';
+					gp[2].mode &= ~ATTR_WDUMMY;
+				}
+				gp[1].u = '\0';
+				gp[1].mode = ATTR_WDUMMY;
 			}
-			gp[1].u = '\0';
-			gp[1].mode = ATTR_WDUMMY;
 		}
 	}
 	if (term.c.x+width < term.col) {
@@ -2403,34 +3412,367 @@ check_control_code:
 	}
 }
 
-int
-twrite(const char *buf, size_t buflen, int show_ctrl)
+/*
+ * Bulk version of tputc() for a run of printable ASCII. The caller has
+ * already checked that no sequence is being parsed and that neither
+ * printing nor insertion is on, so each line segment is copied in one
+ * pass with the same cursor, wrap and selection behaviour as calling
+ * tputc() for every byte.
+ */
+void
+tputascii(const char *s, size_t n)
 {
-    size_t charsize;
-	Rune u;
-	int n;
+	int x, y, k, i, lo, hi, len, seltest, graphic;
+	Glyph g, *gp;
 
-	for (n = 0; n < buflen; n += charsize) {
-		if (IS_SET(MODE_UTF8)) {
-			/* process a complete utf8 char */
-			charsize = utf8decode(buf + n, &u, buflen - n);
-			if (charsize == 0)
-				break;
+	seltest = sel.ob.x != -1;
+	graphic = term.trantbl[term.charset] == CS_GRAPHIC0;
+	g = term.c.attr;
+	while (n > 0) {
+		if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			if (seltest && selected(term.c.x, term.c.y))
+				selclear();
+			gp = &term.line[term.c.y][term.c.x];
+			if (!(gp->mode & ATTR_WRAP)) {
+				gp->mode |= ATTR_WRAP;
+				tsetdirtx(term.c.y, term.c.x, term.c.x);
+			}
+			tnewline(1);
+		} else if ((term.c.state & CURSOR_WRAPNEXT) &&
+		           term.c.x == term.col-1) {
+			/* without autowrap every char lands on the last column */
+			if (seltest && selected(term.c.x, term.c.y))
+				selclear();
+			tsetchar(s[n-1], &term.c.attr, term.c.x, term.c.y);
+			term.lastc = s[n-1];
+			return;
+		}
+
+		x = term.c.x;
+		y = term.c.y;
+		k = MIN(n, term.col - x);
+		gp = &term.line[y][x];
+		lo = k;
+		hi = -1;
+		len = term.info[y].len;
+		if (seltest && selintersect(x, y, x+k-1, y))
+			selclear();
+		for (i = 0; i < k; i++, gp++) {
+			if (gp->mode & (ATTR_WIDE|ATTR_WDUMMY)) {
+				tsetchar(s[i], &term.c.attr, x+i, y);
+				len = -1;
+				continue;
+			}
+			g.u = graphic ? TRANSLATE(s[i]) : s[i];
+			if (GLYPHEQ(*gp, g))
+				continue;
+			*gp = g;
+			lo = MIN(lo, i);
+			hi = i;
+		}
+		if (hi >= 0) {
+			tsetdirtx(y, x+lo, x+hi);
+			/* past the old end of the line there were only spaces */
+			if (len >= 0 && x+lo >= len) {
+				for (i = hi; i >= lo && s[i] == ' '; i--)
+					;
+				term.info[y].len = (i >= lo) ? x+i+1 : len;
+			}
+		}
+		term.lastc = s[k-1];
+
+		if (x+k < term.col) {
+			tmoveto(x+k, y);
+		} else {
+			if (k > 1)
+				tmoveto(term.col-1, y);
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
+		s += k;
+		n -= k;
+	}
+}
+
+/*
+ * Same as tputascii() for decoded runes. It writes the longest prefix of
+ * u made of printable runes of width 1 or 2 and returns its length, the
+ * rune that stopped it is left to tputc(). The charset is resolved once,
+ * wide char fixups of the neighbours are only needed at the edges of each
+ * line segment and the cells that change are marked dirty once per line.
+ */
+size_t
+tputrun(const Rune *u, size_t n)
+{
+	int x, y, w, xl, lo, hi, seltest, graphic;
+	ushort oldmode;
+	size_t i;
+	Glyph g, *gp, *line;
+
+	seltest = sel.ob.x != -1;
+	graphic = term.trantbl[term.charset] == CS_GRAPHIC0;
+	for (i = 0; i < n; ) {
+		if (ISCONTROL(u[i]) || (w = runewidth(u[i])) == 0)
+			break;
+		if (term.c.state & CURSOR_WRAPNEXT) {
+			if (!IS_SET(MODE_WRAP)) {
+				/* every char lands on the last column */
+				tputc(u[i++]);
+				continue;
+			}
+			if (seltest && selected(term.c.x, term.c.y))
+				selclear();
+			gp = &term.line[term.c.y][term.c.x];
+			if (!(gp->mode & ATTR_WRAP)) {
+				gp->mode |= ATTR_WRAP;
+				tsetdirtx(term.c.y, term.c.x, term.c.x);
+			}
+			tnewline(1);
+		}
+		if (term.c.x + w > term.col) {
+			/* wide char that does not fit in the last column */
+			tputc(u[i++]);
+			continue;
+		}
+
+		x = xl = term.c.x;
+		y = term.c.y;
+		line = term.line[y];
+		lo = term.col;
+		hi = -1;
+		if ((line[x].mode & ATTR_WDUMMY) && x > 0) {
+			line[x-1].u = ' ';
+			line[x-1].mode &= ~ATTR_WIDE;
+			lo = hi = x-1;
+		}
+		oldmode = 0;
+		do {
+			g = term.c.attr;
+			g.u = graphic ? TRANSLATE(u[i]) : u[i];
+			oldmode = line[x].mode;
+			if (w == 2) {
+				g.mode |= ATTR_WIDE;
+				oldmode = line[x+1].mode;
+			}
+			if (!GLYPHEQ(line[x], g) || (w == 2 &&
+			    (line[x+1].u != '\0' || line[x+1].mode != ATTR_WDUMMY))) {
+				line[x] = g;
+				if (w == 2) {
+					line[x+1].u = '\0';
+					line[x+1].mode = ATTR_WDUMMY;
+				}
+				lo = MIN(lo, x);
+				hi = x + w-1;
+			}
+			xl = x;
+			x += w;
+		} while (++i < n && !ISCONTROL(u[i]) &&
+		         (w = runewidth(u[i])) != 0 && x + w <= term.col);
+		if ((oldmode & ATTR_WIDE) && x < term.col) {
+			line[x].u = ' ';
+			line[x].mode &= ~ATTR_WDUMMY;
+			lo = MIN(lo, x);
+			hi = x;
+		}
+		if (seltest && selintersect(term.c.x, y, x-1, y))
+			selclear();
+		if (hi >= 0)
+			tsetdirtx(y, lo, hi);
+		term.lastc = u[i-1];
+
+		if (x < term.col) {
+			tmoveto(x, y);
 		} else {
-			u = buf[n] & 0xFF;
+			tmoveto(xl, y);
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
+	}
+	return i;
+}
+
+void
+twriterune(Rune u, int show_ctrl)
+{
+	if (show_ctrl && ISCONTROL(u)) {
+		if (u & 0x80) {
+			u &= 0x7f;
+			tputc('^');
+			tputc('[');
+		} else if (u != '\n' && u != '\r' && u != '\t') {
+			u ^= 0x40;
+			tputc('^');
+		}
+	}
+	tputc(u);
+}
+
+/*
+ * returns the length of the printable ASCII, newline, carriage return,
+ * tab or complete SGR sequence at s, 0 for anything else
+ */
+size_t
+floodrun(const char *s, size_t n)
+{
+	size_t k;
+
+	if ((k = asciirun(s, n)) > 0)
+		return k;
+	if (*s == '\n' || *s == '\r' || *s == '\t')
+		return 1;
+	if (n < 3 || s[0] != '\033' || s[1] != '[')
+		return 0;
+	for (k = 2; k < n && (BETWEEN(s[k], '0', '9') ||
+	     s[k] == ';' || s[k] == ':'); k++)
+		/* nothing */ ;
+	return (k < n && s[k] == 'm') ? k+1 : 0;
+}
+
+/*
+ * moves the cursor kept by tflood() over the k bytes at s, as one token
+ * of floodrun(), and returns the lines it scrolls at the bottom
+ */
+int
+floodstep(const char *s, size_t k, int *x, int *wrap)
+{
+	int t, n = 0;
+
+	switch (*s) {
+	case '\n':
+		if (IS_SET(MODE_CRLF))
+			*x = 0;
+		*wrap = 0;
+		return 1;
+	case '\r':
+		*x = *wrap = 0;
+		return 0;
+	case '\t':
+		/* as tputtab(), which leaves a pending wrap alone */
+		if (!*wrap) {
+			for (t = *x + 1; t < term.col && !term.tabs[t]; ++t)
+				/* nothing */ ;
+			*x = MIN(t, term.col-1);
+		}
+		return 0;
+	case '\033':
+		return 0;
+	}
+	/* t is where the next char goes, term.col if it wraps */
+	t = *x + *wrap + (int)k;
+	if (t > term.col) {
+		n = (t-1) / term.col;
+		t = (t-1) % term.col + 1;
+	}
+	*wrap = t == term.col;
+	*x = t - *wrap;
+	return n;
+}
+
+/*
+ * Under a flood of output most lines scroll away before they could be
+ * seen. When no scrollback keeps them, on the alternate screen or with
+ * histbytes at 0, whatever buf leaves on a full scroll region before
+ * another screenful of scrolling is gone by the time twrite() returns.
+ * Up to the last newline where that holds, buf is not written at all:
+ * only the cursor, the attributes and the count of scrolled lines are
+ * kept up to date. Returns the bytes consumed.
+ */
+size_t
+tflood(const char *buf, size_t len)
+{
+	size_t i, j, k, end, cut;
+	int x, wrap, total, scrolls, cx, cscrolls;
+
+	if (!IS_SET(MODE_WRAP) || sel.ob.x != -1 ||
+	    (histbytes > 0 && !IS_SET(MODE_ALTSCREEN)) ||
+	    term.top != 0 || term.bot != term.row-1 || term.c.y != term.bot)
+		return 0;
+
+	x = term.c.x;
+	wrap = (term.c.state & CURSOR_WRAPNEXT) != 0;
+	for (end = total = 0; end < len &&
+	     (k = floodrun(buf + end, len - end)) > 0; end += k)
+		total += floodstep(buf + end, k, &x, &wrap);
+	if (total <= term.row)
+		return 0;
+
+	x = cx = term.c.x;
+	wrap = (term.c.state & CURSOR_WRAPNEXT) != 0;
+	scrolls = cscrolls = 0;
+	for (i = cut = 0; i < end; i += k) {
+		k = floodrun(buf + i, len - i);
+		scrolls += floodstep(buf + i, k, &x, &wrap);
+		if (buf[i] != '\n')
+			continue;
+		if (total - scrolls < term.row)
+			break;
+		/* the line is certain to go, catch up with its attributes */
+		for (j = cut; j < i; j++) {
+			if (buf[j] != '\033')
+				continue;
+			for (; buf[j] != 'm'; j++)
+				tputc(buf[j]);
+			tputc('m');
+		}
+		cut = i + 1;
+		cx = x;
+		cscrolls = scrolls;
+	}
+	if (cut == 0)
+		return 0;
+	tmoveto(cx, term.c.y);
+	term.scrolled += cscrolls;
+	term.lastc = 0;
+	return cut;
+}
+
+int
+twrite(const char *buf, size_t buflen, int show_ctrl)
+{
+	Rune ubuf[256];
+	uchar lbuf[LEN(ubuf)];
+	size_t charsize, nu, i, k;
+	int n = 0;
+
+	/* output shows the screen again */
+	if (term.scr)
+		tviewscroll(-term.scr);
+	if (term.esc == ESC_GROUND && !show_ctrl &&
+	    !IS_SET(MODE_PRINT|MODE_INSERT))
+		n = tflood(buf, buflen);
+	for (; n < buflen; n += charsize) {
+		/*
+		 * Plain text outside of any sequence is by far the most
+		 * common input, so copy runs of it straight into the line.
+		 */
+		if (term.esc == ESC_GROUND &&
+		    !IS_SET(MODE_PRINT|MODE_INSERT) &&
+		    (charsize = asciirun(buf + n, buflen - n)) > 0) {
+			tputascii(buf + n, charsize);
+			continue;
+		}
+		if (!IS_SET(MODE_UTF8) || !(buf[n] & 0x80)) {
 			charsize = 1;
+			twriterune(buf[n] & 0xFF, show_ctrl);
+			continue;
 		}
-		if (show_ctrl && ISCONTROL(u)) {
-			if (u & 0x80) {
-				u &= 0x7f;
-				tputc('^');
-				tputc('[');
-			} else if (u != '\n' && u != '\r' && u != '\t') {
-				u ^= 0x40;
-				tputc('^');
+		/*
+		 * decode the whole run of multibyte chars at once, stop
+		 * early if one of them turns UTF-8 off
+		 */
+		nu = utf8decodebuf(buf + n, buflen - n, ubuf, lbuf, LEN(ubuf));
+		if (nu == 0)
+			break; /* keep the incomplete sequence for later */
+		for (i = 0, charsize = 0; i < nu && IS_SET(MODE_UTF8); ) {
+			k = 0;
+			if (term.esc == ESC_GROUND &&
+			    !IS_SET(MODE_PRINT|MODE_INSERT))
+				k = tputrun(ubuf + i, nu - i);
+			if (k == 0) {
+				twriterune(ubuf[i], show_ctrl);
+				k = 1;
 			}
+			while (k-- > 0)
+				charsize += lbuf[i++];
 		}
-		tputc(u);
 	}
 	return n;
 }
@@ -2450,12 +3792,29 @@ tresize(int col, int row)
 		return;
 	}
 
+	if (term.scr)
+		tviewscroll(-term.scr);
+
+	/* move the slid windows back to the start of their buffers */
+	if (term.row > 0) {
+		memmove(term.linebuf, term.line, term.row * sizeof(Line));
+		memmove(term.altbuf, term.alt, term.row * sizeof(Line));
+		memmove(term.dirtybuf, term.dirty,
+		        term.row * sizeof(*term.dirty));
+		term.line = term.linebuf;
+		term.alt = term.altbuf;
+		term.dirty = term.dirtybuf;
+		term.info = term.infobuf;
+	}
+
 	/*
 	 * slide screen to keep cursor where we expect it -
 	 * tscrollup would work here, but we can optimize to
 	 * memmove because we're freeing the earlier lines
 	 */
 	for (i = 0; i <= term.c.y - row; i++) {
+		histpush(IS_SET(MODE_ALTSCREEN) ? term.alt[i] : term.line[i],
+		         term.col);
 		free(term.line[i]);
 		free(term.alt[i]);
 	}
@@ -2470,9 +3829,17 @@ tresize(int col, int row)
 	}
 
 	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
-	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
+	term.line = term.linebuf = xrealloc(term.line,
+	                                    LINEBUF_SIZ(row) * sizeof(Line));
+	term.alt = term.altbuf = xrealloc(term.alt,
+	                                  LINEBUF_SIZ(row) * sizeof(Line));
+	term.dirty = term.dirtybuf = xrealloc(term.dirty,
+	                              LINEBUF_SIZ(row) * sizeof(*term.dirty));
+	term.info = term.infobuf = xrealloc(term.info,
+	                              LINEBUF_SIZ(row) * sizeof(*term.info));
+	term.damage = xrealloc(term.damage, row * sizeof(*term.damage));
+	for (i = 0; i < row; i++)
+		term.damage[i] = clean;
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
 	/* resize each row to new width, zero-pad if needed */
@@ -2486,6 +3853,11 @@ tresize(int col, int row)
 		term.line[i] = xmalloc(col * sizeof(Glyph));
 		term.alt[i] = xmalloc(col * sizeof(Glyph));
 	}
+	for (i = 0; i < term.row; i++)
+		free(term.view[i]);
+	term.view = xrealloc(term.view, row * sizeof(Line));
+	for (i = 0; i < row; i++)
+		term.view[i] = xmalloc(col * sizeof(Glyph));
 	if (col > term.col) {
 		bp = term.tabs + term.col;
 
@@ -2498,6 +3870,13 @@ tresize(int col, int row)
 	/* update terminal size */
 	term.col = col;
 	term.row = row;
+	/* whatever was drawn before has the wrong size now */
+	term.scrolled = 0;
+	tfulldirt();
+	for (i = 0; i < row; i++)
+		term.info[i] = unknown;
+	sel.span = xrealloc(sel.span, row * sizeof(*sel.span));
+	selspan();
 	/* reset scrolling region */
 	tsetscroll(0, row-1);
 	/* make use of the LIMIT in tmoveto */
@@ -2526,38 +3905,114 @@ resettitle(void)
 void
 drawregion(int x1, int y1, int x2, int y2)
 {
+	Span s;
 	int y;
 
 	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y])
+		s = term.dirty[y];
+		if (s.x0 > s.x1)
 			continue;
 
-		term.dirty[y] = 0;
-        macos_drawline(term.line[y], x1, y, x2);
+		term.dirty[y] = clean;
+		s.x0 = MAX(s.x0, x1);
+		s.x1 = MIN(s.x1, x2 - 1);
+		term.damage[y].x0 = MIN(term.damage[y].x0, s.x0);
+		term.damage[y].x1 = MAX(term.damage[y].x1, s.x1);
+        macos_drawline(TLINE(y), s.x0, y, s.x1 + 1);
+	}
+}
+
+/*
+ * The damage is what draw() found changed since the last tdamageend(),
+ * a renderer keeping its own copy of the screen only has to update
+ * those cells:
+ *
+ *	tdamagebegin();
+ *	while (tdamagenext(&y, &x0, &x1))
+ *		copy columns x0 to x1 of TLINE(y);
+ *	tdamageend();
+ */
+void
+tdamagebegin(void)
+{
+	damagey = 0;
+}
+
+int
+tdamagenext(int *y, int *x0, int *x1)
+{
+	for (; damagey < term.row; damagey++) {
+		if (term.damage[damagey].x0 <= term.damage[damagey].x1) {
+			*y = damagey;
+			*x0 = term.damage[damagey].x0;
+			*x1 = term.damage[damagey].x1;
+			term.damage[damagey++] = clean;
+			return 1;
+		}
 	}
+	return 0;
+}
+
+void
+tdamageend(void)
+{
+	int y;
+
+	for (y = damagey; y < term.row; y++)
+		term.damage[y] = clean;
+}
+
+/* damage not taken yet moves with the lines the backend moved */
+void
+tshiftdamage(int n)
+{
+	int y, k = abs(n);
+
+	if (n > 0)
+		memmove(term.damage, term.damage + k,
+		        (term.row - k) * sizeof(*term.damage));
+	else
+		memmove(term.damage + k, term.damage,
+		        (term.row - k) * sizeof(*term.damage));
+	for (y = (n > 0) ? term.row - k : 0; k > 0; k--, y++)
+		term.damage[y] = clean;
 }
 
 void
 draw(void)
 {
-	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+	int cx = term.c.x, cy = term.c.y + term.scr;
+	int ocx = term.ocx, ocy = term.ocy;
 
 	if (!macos_startdraw())
 		return;
 
+	/* let the backend move what it already drew, or redraw it all */
+	if (term.scrolled) {
+		if (abs(term.scrolled) >= term.row ||
+		    !macos_scroll(term.scrolled))
+			tfulldirt();
+		else
+			tshiftdamage(term.scrolled);
+		term.scrolled = 0;
+	}
+
 	/* adjust cursor position */
 	LIMIT(term.ocx, 0, term.col-1);
 	LIMIT(term.ocy, 0, term.row-1);
-	if (term.line[term.ocy][term.ocx].mode & ATTR_WDUMMY)
+	if (TLINE(term.ocy)[term.ocx].mode & ATTR_WDUMMY)
 		term.ocx--;
-	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
+	if (cy < term.row && TLINE(cy)[cx].mode & ATTR_WDUMMY)
 		cx--;
 
 	drawregion(0, 0, term.col, term.row);
-    macos_drawcursor(cx, term.c.y, term.line[term.c.y][cx],
-			term.ocx, term.ocy, term.line[term.ocy][term.ocx]);
-	term.ocx = cx;
-	term.ocy = term.c.y;
+	/* scrolled back far enough the cursor is below the rows shown */
+	if (cy < term.row) {
+		macos_drawcursor(cx, cy, TLINE(cy)[cx],
+				term.ocx, term.ocy, TLINE(term.ocy)[term.ocx]);
+		term.ocx = cx;
+		term.ocy = cy;
+	}
     macos_finishdraw();
 	if (ocx != term.ocx || ocy != term.ocy)
         macos_ximspot(term.ocx, term.ocy);
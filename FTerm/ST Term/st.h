@@ -20,8 +20,8 @@
 #define DIVCEIL(n, d)		(((n) + ((d) - 1)) / (d))
 #define DEFAULT(a, b)		(a) = (a) ? (a) : (b)
 #define LIMIT(x, a, b)		(x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b)		((a).mode != (b).mode || (a).fg != (b).fg || \
-				(a).bg != (b).bg)
+#define ATTRCMP(a, b)		((a).mode != (b).mode || (a).style != (b).style)
+#define GLYPHEQ(a, b)		((a).u == (b).u && !ATTRCMP(a, b))
 #define TIMEDIFF(t1, t2)	((t1.tv_sec-t2.tv_sec)*1000 + \
 				(t1.tv_nsec-t2.tv_nsec)/1E6)
 #define MODBIT(x, set, bit)	((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
@@ -72,9 +72,22 @@ typedef uint_least32_t Rune;
 typedef struct {
 	Rune u;           /* character code */
 	ushort mode;      /* attribute flags */
+	ushort style;     /* colors, index in styles */
+} Glyph;
+
+#define Style Style_
+typedef struct {
 	uint32_t fg;      /* foreground  */
 	uint32_t bg;      /* background  */
-} Glyph;
+} Style;
+
+#define STYLE_MAX	65536
+
+extern Style styles[STYLE_MAX];
+extern int nstyles;
+extern int styleslo;
+extern int blinkset;
+extern int syncset;
 
 typedef Glyph *Line;
 
@@ -89,12 +102,18 @@ typedef union {
 void die(const char *, ...);
 void redraw(void);
 void draw(void);
+void tdamagebegin(void);
+int tdamagenext(int *, int *, int *);
+void tdamageend(void);
 
+void kscrolldown(const Arg *);
+void kscrollup(const Arg *);
 void printscreen(const Arg *);
 void printsel(const Arg *);
 void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
+ushort styleid(uint32_t, uint32_t);
 int tattrset(int);
 void tnew(int, int);
 void tresize(int, int);
@@ -102,8 +121,10 @@ void tsetdirtattr(int);
 void ttyhangup(void);
 int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
+void ttyhandoff(void (*)(const char *, size_t));
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
+int twrite(const char *, size_t, int);
 
 void resettitle(void);
 
@@ -112,6 +133,9 @@ void selinit(void);
 void selstart(int, int, int);
 void selextend(int, int, int, int);
 int selected(int, int);
+int selintersect(int, int, int, int);
+int selcols(int, int *, int *);
+int selstream(int (*)(const char *, size_t, void *), void *);
 char *getsel(void);
 
 size_t utf8encode(Rune, char *);
@@ -133,5 +157,14 @@ extern unsigned int tabspaces;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern unsigned int defaultcs;
+extern unsigned int histbytes;
+extern unsigned int histdisk;
+extern char *histdir;
+extern unsigned int readbudget;
+extern unsigned int readbudgetms;
+extern unsigned int blinktimeout;
+extern unsigned int synctimeout;
+extern double minlatency;
+extern double maxlatency;
 
 #endif /* st_h */
@@ -16,13 +16,16 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
+#define LINEBUF_SIZ(row) (4*(row)) /* room to slide the screen, see tslide */
 
 /* macros */
 #define IS_SET(flag)        ((term.mode & (flag)) != 0)
 #define ISCONTROLC0(c)        (BETWEEN(c, 0, 0x1f) || (c) == 0x7f)
 #define ISCONTROLC1(c)        (BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)        (ISCONTROLC0(c) || ISCONTROLC1(c))
-#define ISDELIM(u)        (u && wcschr(worddelimiters, u))
+#define ISDELIM(u)        ((u) < 0x10000 ? delimmap[(u) >> 6] >> ((u) & 63) & 1 : \
+                           wcschr(worddelimiters, u) != NULL)
+#define TLINE(y)        ((y) < term.scr ? term.view[y] : term.line[(y) - term.scr])
 
 enum term_mode {
     MODE_WRAP        = 1 << 0,
@@ -32,6 +35,9 @@ enum term_mode {
     MODE_ECHO        = 1 << 4,
     MODE_PRINT       = 1 << 5,
     MODE_UTF8        = 1 << 6,
+    MODE_SYNC        = 1 << 7,
+    MODE_PASTE       = 1 << 8,  /* bracketed paste, mode 2004 */
+    MODE_BLINKOFF    = 1 << 9,  /* blinking text is hidden now */
 };
 
 enum cursor_movement {
@@ -55,14 +61,15 @@ enum charset {
     CS_FIN
 };
 
+/* parser states, see esctrans in st.c */
 enum escape_state {
-    ESC_START      = 1,
-    ESC_CSI        = 2,
-    ESC_STR        = 4,  /* DCS, OSC, PM, APC */
-    ESC_ALTCHARSET = 8,
-    ESC_STR_END    = 16, /* a final string was encountered */
-    ESC_TEST       = 32, /* Enter in test mode */
-    ESC_UTF8       = 64,
+    ESC_GROUND,          /* no sequence in progress */
+    ESC_START,
+    ESC_CSI,
+    ESC_STR,             /* DCS, OSC, PM, APC */
+    ESC_ALTCHARSET,
+    ESC_TEST,            /* Enter in test mode */
+    ESC_UTF8,
 };
 
 typedef struct {
@@ -72,6 +79,12 @@ typedef struct {
     char state;
 } TCursor;
 
+/* columns x0 to x1 of a line, x0 > x1 when there are none */
+typedef struct {
+    int x0;
+    int x1;
+} Span;
+
 typedef struct {
     int mode;
     int type;
@@ -88,22 +101,39 @@ typedef struct {
     } nb, ne, ob, oe;
 
     int alt;
+    Span *span;  /* selected columns of each line, see selspan() */
 } Selection;
 
+/* what is known of a line, reset by every write to it */
+typedef struct {
+    int blank;  /* style+1 if it is known to be cleared, else 0 */
+    int len;    /* tlinelen(), -1 if not known */
+} LineInfo;
+
 /* Internal representation of the screen */
 typedef struct {
     int row;      /* nb row */
     int col;      /* nb col */
     Line *line;   /* screen */
     Line *alt;    /* alternate screen */
-    int *dirty;   /* dirtyness of lines */
+    Line *linebuf; /* storage the screen is a window of */
+    Line *altbuf; /* storage the alternate screen is a window of */
+    Span *dirty;  /* changed columns of lines since the last draw */
+    Span *dirtybuf; /* storage the dirty spans are a window of */
+    Span *damage; /* changed columns drawn since the renderer looked */
+    LineInfo *info; /* what is known of the contents of lines */
+    LineInfo *infobuf; /* storage the line infos are a window of */
+    int scrolled; /* lines slid up (negative: down) since the last draw */
+    int scr;      /* history lines shown above the screen, see tviewscroll */
+    Line *view;   /* the history lines shown, row of them */
     TCursor c;    /* cursor */
     int ocx;      /* old cursor col */
     int ocy;      /* old cursor row */
     int top;      /* top    scroll limit */
     int bot;      /* bottom scroll limit */
     int mode;     /* terminal mode flags */
-    int esc;      /* escape state flags */
+    int esc;      /* escape parser state */
+    int strend;   /* a final string was encountered */
     char trantbl[4]; /* charset table translation */
     int charset;  /* current charset */
     int icharset; /* selected charset for sequence */
@@ -120,6 +150,7 @@ typedef struct {
     int arg[ESC_ARG_SIZ];
     int narg;              /* nb of args */
     char mode[2];
+    int nmode;             /* nb of mode chars seen */
 } CSIEscape;
 
 /* STR Escape sequence structs */
@@ -0,0 +1,156 @@
+//
+//  twritebench.c
+//  FTerm
+//
+//  Throughput of twrite() on what a terminal is mostly given: a build
+//  log of plain ASCII, the same log colored the way compilers do and
+//  text with multibyte UTF-8 in it. Each corpus is made up the same on
+//  every run and fed in reads of READ bytes, as the pipeline does, on
+//  an 80x24 screen. Not part of make check, run it with make bench.
+//
+
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "st.h"
+#include "st_types.h"
+#include "config.def.h"
+
+#define CORPUS		(32 << 20)	/* bytes of each corpus */
+#define READ		4096
+#define RUNS		3		/* the best of them is reported */
+
+typedef int (*Lineproc)(char *, size_t, uint32_t);
+
+static int plainline(char *, size_t, uint32_t);
+static int colorline(char *, size_t, uint32_t);
+static int utf8line(char *, size_t, uint32_t);
+static char *corpus(Lineproc, size_t *);
+static double feed(const char *, size_t);
+
+/* like make: a compiler command or a warning, 70 to 200 columns */
+int
+plainline(char *buf, size_t siz, uint32_t r)
+{
+	if (r % 5)
+		return snprintf(buf, siz, "cc -O2 -Wall -Iinclude -DVERSION=%u "
+		                "-c src/module%u/file%u.c -o obj/file%u.o%.*s\r\n",
+		                r % 97, r % 13, r % 1000, r % 1000,
+		                (int)(r % 120), "  -fno-strict-aliasing "
+		                "-fPIC -pipe -g -MMD -MP -MF obj/.deps/file.d "
+		                "-fstack-protector-strong -D_FORTIFY_SOURCE=2 "
+		                "-std=gnu11");
+	return snprintf(buf, siz, "src/module%u/file%u.c:%u:%u: warning: "
+	                "unused variable 'tmp%u' [-Wunused-variable]\r\n",
+	                r % 13, r % 1000, r % 4000, r % 80, r % 10);
+}
+
+/* the warnings with their location bold and the kind in color */
+int
+colorline(char *buf, size_t siz, uint32_t r)
+{
+	if (r % 5)
+		return plainline(buf, siz, r);
+	return snprintf(buf, siz, "\033[1msrc/module%u/file%u.c:%u:%u:\033[m "
+	                "\033[1;35mwarning:\033[m unused variable '\033[1mtmp%u"
+	                "\033[m' [\033[1;35m-Wunused-variable\033[m]\r\n",
+	                r % 13, r % 1000, r % 4000, r % 80, r % 10);
+}
+
+/* text with a word now and then in another script */
+int
+utf8line(char *buf, size_t siz, uint32_t r)
+{
+	static const char *words[] = {
+		"the", "terminal", "draws", "what", "it", "is", "given",
+		"Grüße", "naïve", "déjà", "наука", "данные", "λόγος",
+		"日本語", "変換", "→", "…",
+	};
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < 12; i++, r = r * 1103515245 + 12345) {
+		n += snprintf(buf + n, siz - n, "%s ", words[(r >> 16) %
+		              ((r >> 8) % 4 ? 7 : LEN(words))]);
+	}
+	n += snprintf(buf + n, siz - n, "\r\n");
+	return n;
+}
+
+/* CORPUS bytes of lines made by line, the same each run */
+char *
+corpus(Lineproc line, size_t *len)
+{
+	char *buf = xmalloc(CORPUS + 1024);
+	uint32_t r = 1;
+	size_t n = 0;
+
+	while (n < CORPUS) {
+		r = r * 2654435761u + 12345;
+		n += line(buf + n, 1024, r ^ r >> 15);
+	}
+	*len = n;
+	return buf;
+}
+
+/* ms twrite() takes over the corpus, split runes go on to the next read */
+double
+feed(const char *buf, size_t len)
+{
+	struct timespec start, now;
+	char chunk[READ + UTF_SIZ];
+	size_t n, left = 0;
+	int done;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (len > 0) {
+		n = MIN(len, READ);
+		memcpy(chunk + left, buf, n);
+		buf += n;
+		len -= n;
+		n += left;
+		done = twrite(chunk, n, 0);
+		left = n - done;
+		memmove(chunk, chunk + done, left);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TIMEDIFF(now, start);
+}
+
+int
+main(void)
+{
+	static const struct {
+		const char *name;
+		Lineproc line;
+	} corpora[] = {
+		{ "build log", plainline },
+		{ "colored log", colorline },
+		{ "utf-8 text", utf8line },
+	};
+	double ms, best;
+	size_t len;
+	char *buf;
+	int i, k;
+
+	setlocale(LC_CTYPE, "");
+	tnew(80, 24);
+	selinit();
+	for (i = 0; i < LEN(corpora); i++) {
+		buf = corpus(corpora[i].line, &len);
+		for (best = 0, k = 0; k < RUNS; k++) {
+			ms = feed(buf, len);
+			if (best == 0 || ms < best)
+				best = ms;
+		}
+		printf("twritebench: %-12s %6.1f MB/s\n", corpora[i].name,
+		       len / 1048576.0 / (best / 1000));
+		free(buf);
+	}
+	return 0;
+}
@@ -14,6 +14,7 @@ Header containing types and enum constants shared between Metal shaders and C/Ob
 #define MAX_ROW     512
 #define MAX_COL     512
 #define MAX_COLOR_TABLE_ENTRY 1024
+#define MAX_STYLE   65536
 
 // Buffer index values shared between shader and C code to ensure Metal shader buffer inputs
 // match Metal API buffer set calls.
@@ -58,12 +59,17 @@ typedef struct {
 
 typedef uint32_t Rune;
 
+// same layout as Glyph and Style in st.h, the grid is copied as is
 typedef struct {
     Rune u;           /* character code */
     ushort mode;      /* attribute flags */
+    ushort style;     /* colors, index in styles */
+} Glyph;
+
+typedef struct {
     uint32_t fg;      /* foreground  */
     uint32_t bg;      /* background  */
-} Glyph;
+} Style;
 
 typedef struct {
     int cx, cy;
@@ -90,6 +96,7 @@ typedef struct {
 
     Cursor cursor;
     
+    Style styles[MAX_STYLE];
     Glyph character_buffer[MAX_ROW * MAX_COL];
 } FTermBuffer;
 
@@ -110,8 +110,8 @@ fragment float4 termFragmentShader(RasterizerData in [[stage_in]],
         
         int fg, bg;
         
-        fg = glyph.fg;
-        bg = glyph.bg;
+        fg = ftBuffer->styles[glyph.style].fg;
+        bg = ftBuffer->styles[glyph.style].bg;
         
         if (fg < MAX_COLOR_TABLE_ENTRY)
         {